@@ -311,24 +311,34 @@ void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, reqperm, r;
 	void *pg;
 
+	// Each pass sends the reply to the previous request (if any) and
+	// waits for the next one in a single system call.
+	whom = 0;
+	r = 0;
+	pg = NULL;
+	perm = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		reqperm = 0;
+		req = ipc_reply_wait(whom, r, pg, perm,
+				     (int32_t *) &whom, fsreq, &reqperm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		pg = NULL;
+		perm = 0;
+
 		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		if (!(reqperm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
@@ -337,7 +347,8 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
+		// Don't keep the client's page mapped while we wait for the
+		// next request.
 		sys_page_unmap(0, fsreq);
 	}
 }
@@ -38,6 +38,12 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Notification bits (see sys_notify).  Bit 31 is not a notification bit,
+// so that sys_notify_wait can return the bits that fired as a positive
+// int.  The kernel itself sends the top remaining bit.
+#define NOTIFY_ALL		0x7FFFFFFF
+#define NOTIFY_CONS		0x40000000	// Console input arrived
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -45,7 +51,8 @@ enum EnvType {
 };
 
 struct Env {
-    int priority;
+    int priority;			// Effective priority (lower runs first)
+	int env_base_priority;		// Priority set by sys_env_set_priority
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
 	envid_t env_id;			// Unique environment identifier
@@ -57,9 +64,11 @@ struct Env {
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+					// (shared by threads; see sys_thread_create)
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of this env's exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -67,6 +76,35 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recv_from;	// Only receive from this env (0 = any)
+
+	// Blocking IPC send queue
+	struct Env *env_ipc_sendq;	// First env blocked sending to us
+	struct Env *env_ipc_sendq_tail;	// Last env blocked sending to us
+	struct Env *env_ipc_sendq_next;	// Next sender queued on the same env
+	struct Env *env_ipc_sendto;	// Env we are blocked sending to
+	uint32_t env_ipc_send_value;	// Value we are blocked sending
+	void *env_ipc_send_srcva;	// Page we are blocked sending
+	int env_ipc_send_perm;		// Perm of the page we are blocked sending
+	bool env_ipc_calling;		// Wait for a reply once the send is done
+	envid_t env_ipc_client;		// Caller we owe a reply (lends priority)
+
+	// Exit notification
+	int env_exit_status;		// Reported to waiters when we are freed
+	struct Env *env_waiters;	// Envs blocked in sys_env_wait on us
+	struct Env *env_wait_next;	// Next waiter on the same env
+	struct Env *env_wait_for;	// Env we are blocked waiting for
+	int env_wait_status;		// Exit status of the env we waited for
+
+	// Futexes (see kern/futex.c)
+	uintptr_t env_futex_key;	// Futex we are blocked on (0 = none)
+	pde_t *env_futex_pgdir;		//   and its address space, if any
+	struct Env *env_futex_next;	// Next waiter on the same futex bucket
+	uint32_t env_futex_gen;		// futex_unmap_gen as of our last syscall
+
+	// Notifications
+	uint32_t env_notify;		// Bits sent to us and not yet taken
+	uint32_t env_notify_mask;	// Bits we are blocked on (0 = none)
 };
 
 #endif // !JOS_INC_ENV_H
@@ -26,6 +26,8 @@ enum {
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
 
+	E_AGAIN		,	// Value changed under sys_futex_wait
+
 	MAXERROR
 };
 
@@ -28,7 +28,8 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+// Each thread has its own thisenv (see thread.c).
+#define thisenv		(*thisenv_ptr())
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -47,7 +48,9 @@ int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+int	sys_env_wait(envid_t env);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int sys_env_set_priority(envid_t env, int priority);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
@@ -57,8 +60,20 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
 int sys_exec(uint32_t eip, uint32_t esp, void * ph, uint32_t phnum);
+int	sys_ring_enter(struct SysRing *ring);
+envid_t	sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t uxstacktop);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_notify(envid_t envid, uint32_t bits);
+int	sys_notify_wait(uint32_t mask);
+int	sys_region_reserve(void *va, size_t len, int perm);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -74,10 +89,13 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t fork_with_priority(int priority);
 envid_t	sfork(void);	// Challenge!
@@ -120,7 +138,25 @@ int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
 
 // wait.c
-void	wait(envid_t env);
+int	wait(envid_t env);
+
+// sysring.c
+int	sysring_queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		      uint32_t a4, uint32_t a5);
+int	sysring_flush(void);
+void	sysring_discard(void);
+
+// thread.c
+envid_t	thread_create(void (*fn)(void *), void *arg);
+void	thread_exit(void);
+int	thread_join(envid_t tid);
+const volatile struct Env **thisenv_ptr(void);
+struct SysRing *thread_sysring(void);
+
+// malloc.c
+void	*malloc(size_t n);
+void	free(void *v);
+void	malloc_stats(size_t *inuse, size_t *mapped);
 
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x68     // Per-CPU data segment for CPU 0 (after NCPU TSSs)
 
 /*
  * Virtual memory map:                                Permissions
@@ -56,8 +57,10 @@
  *                     +------------------------------+ 0xeebff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
  *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
- *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     |      Normal User Stack       | RW/RW  USTACKSIZE
+ *                     +------------------------------+ 0xeeafe000
+ *                     |       Empty Memory (*)       | --/--  PGSIZE
+ *                     +------------------------------+ 0xeeafd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -126,6 +129,10 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Most the normal user stack may grow to.  Its pages are mapped as it
+// touches them (see env_setup_vm); the page below is left invalid to
+// guard against stack overflow.
+#define USTACKSIZE	(256*PGSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -135,6 +142,9 @@
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+// The user library's system call ring (see lib/sysring.c).  Private to
+// each environment; mapped on first use.
+#define USYSRING	(PFTEMP - PGSIZE)
 
 #define ETEMP 0xe0000000
 // The location of the user-level STABS data structure
@@ -187,6 +197,19 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// While the page heads a free block of the buddy allocator
+	// (kern/pmap.c): the block's size, as log2 of its pages, and
+	// the previous block on the same free list.
+	uint8_t pp_order;
+	bool pp_free;
+	struct PageInfo *pp_prev;
+
+	// While the page waits out a TLB shootdown (see tlb_flush in
+	// kern/pmap.c): the references to drop once every CPU has taken
+	// it, and the latest such shootdown.
+	uint16_t pp_hold;
+	uint32_t pp_hold_epoch;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -11,6 +13,7 @@ enum {
 	SYS_page_map,
 	SYS_page_unmap,
 	SYS_exofork,
+	SYS_fork,
     SYS_env_set_priority,
 	SYS_env_set_status,
 	SYS_env_set_trapframe,
@@ -18,8 +21,42 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_env_wait,
     SYS_exec,
+	SYS_ring_enter,
+	SYS_thread_create,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_notify,
+	SYS_notify_wait,
+	SYS_region_reserve,
 	NSYSCALLS
 };
 
+// A batch of system calls, queued in a page of user memory and run by
+// one sys_ring_enter.  The user fills sq[] and advances sq_tail; the
+// kernel runs entries in order, advancing sq_head, and posts each return
+// value to cq[], advancing cq_tail; the user consumes results by
+// advancing cq_head.  Indices are free-running and wrap mod SYSRING_SIZE.
+// Only calls that neither block nor switch environments may be queued:
+// page_alloc, page_map, page_unmap and the env_set_* calls.
+#define SYSRING_SIZE	64
+
+struct SysRingEntry {
+	uint32_t num;
+	uint32_t args[5];
+};
+
+struct SysRing {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct SysRingEntry sq[SYSRING_SIZE];
+	int32_t cq[SYSRING_SIZE];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
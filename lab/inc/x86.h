@@ -240,6 +240,32 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// Model-specific registers for the sysenter fast system call entry
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t) val),
+		     "d" ((uint32_t) (val >> 32)));
+}
+
+// Whether this CPU implements sysenter/sysexit.  Early Pentium Pros
+// (family 6, model < 3, stepping < 3) set the SEP bit without them.
+static inline bool
+cpu_has_sysenter(void)
+{
+	uint32_t eax, edx;
+
+	cpuid(1, &eax, NULL, NULL, &edx);
+	if (!(edx & (1 << 11)))
+		return 0;
+	return !(((eax >> 8) & 0xf) == 6 && ((eax >> 4) & 0xf) < 3
+		 && (eax & 0xf) < 3);
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -261,4 +287,41 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'inc' to *addr, returning its old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return inc;
+}
+
+// Atomically set bit 'bit' of *addr, returning its old value.
+static inline bool
+test_and_set_bit(volatile uint32_t *addr, int bit)
+{
+	uint8_t old;
+
+	asm volatile("lock; btsl %2, %0; setc %1"
+		     : "+m" (*addr), "=q" (old)
+		     : "r" (bit)
+		     : "cc", "memory");
+	return old;
+}
+
+// Atomically clear bit 'bit' of *addr, returning its old value.
+static inline bool
+test_and_clear_bit(volatile uint32_t *addr, int bit)
+{
+	uint8_t old;
+
+	asm volatile("lock; btrl %2, %0; setc %1"
+		     : "+m" (*addr), "=q" (old)
+		     : "r" (bit)
+		     : "cc", "memory");
+	return old;
+}
+
 #endif /* !JOS_INC_X86_H */
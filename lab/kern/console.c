@@ -11,6 +11,8 @@
 #include <kern/picirq.h>
 #include <kern/paint.h>
 #include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -49,7 +51,35 @@ delay(void)
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
+// The console lock: protects the VGA buffers and paint state, the
+// serial and parallel ports and the input buffer.  It is a leaf lock.
 struct spinlock vga_lock;
+static struct CpuInfo *vga_lock_holder;
+
+// Take vga_lock unless this CPU already holds it (cprintf from inside
+// the keyboard handler re-enters the console) or the kernel has
+// panicked (the lock may have been held by the CPU that panicked).
+// Returns whether the lock was taken, to be passed to cons_unlock.
+static bool
+cons_lock(void)
+{
+	extern const char *panicstr;
+
+	if (panicstr || vga_lock_holder == thiscpu)
+		return 0;
+	spin_lock(&vga_lock);
+	vga_lock_holder = thiscpu;
+	return 1;
+}
+
+static void
+cons_unlock(bool locked)
+{
+	if (!locked)
+		return;
+	vga_lock_holder = NULL;
+	spin_unlock(&vga_lock);
+}
 
 
 static int vga256_24bit[256] = { 0x000000, 0x0000a8, 0x00a800, 0x00a8a8, 0xa80000, 0xa800a8, 0xa85400, 0xa8a8a8, 0x545454, 0x5454fc, 0x54fc54, 0x54fcfc, 0xfc5454, 0xfc54fc, 0xfcfc54, 0xfcfcfc, 0x000000, 0x141414, 0x202020, 0x2c2c2c, 0x383838, 0x444444, 0x505050, 0x606060, 0x707070, 0x808080, 0x909090, 0xa0a0a0, 0xb4b4b4, 0xc8c8c8, 0xe0e0e0, 0xfcfcfc, 0x0000fc, 0x4000fc, 0x7c00fc, 0xbc00fc, 0xfc00fc, 0xfc00bc, 0xfc007c, 0xfc0040, 0xfc0000, 0xfc4000, 0xfc7c00, 0xfcbc00, 0xfcfc00, 0xbcfc00, 0x7cfc00, 0x40fc00, 0x00fc00, 0x00fc40, 0x00fc7c, 0x00fcbc, 0x00fcfc, 0x00bcfc, 0x007cfc, 0x0040fc, 0x7c7cfc, 0x9c7cfc, 0xbc7cfc, 0xdc7cfc, 0xfc7cfc, 0xfc7cdc, 0xfc7cbc, 0xfc7c9c, 0xfc7c7c, 0xfc9c7c, 0xfcbc7c, 0xfcdc7c, 0xfcfc7c, 0xdcfc7c, 0xbcfc7c, 0x9cfc7c, 0x7cfc7c, 0x7cfc9c, 0x7cfcbc, 0x7cfcdc, 0x7cfcfc, 0x7cdcfc, 0x7cbcfc, 0x7c9cfc, 0xb4b4fc, 0xc4b4fc, 0xd8b4fc, 0xe8b4fc, 0xfcb4fc, 0xfcb4e8, 0xfcb4d8, 0xfcb4c4, 0xfcb4b4, 0xfcc4b4, 0xfcd8b4, 0xfce8b4, 0xfcfcb4, 0xe8fcb4, 0xd8fcb4, 0xc4fcb4, 0xb4fcb4, 0xb4fcc4, 0xb4fcd8, 0xb4fce8, 0xb4fcfc, 0xb4e8fc, 0xb4d8fc, 0xb4c4fc, 0x000070, 0x1c0070, 0x380070, 0x540070, 0x700070, 0x700054, 0x700038, 0x70001c, 0x700000, 0x701c00, 0x703800, 0x705400, 0x707000, 0x547000, 0x387000, 0x1c7000, 0x007000, 0x00701c, 0x007038, 0x007054, 0x007070, 0x005470, 0x003870, 0x001c70, 0x383870, 0x443870, 0x543870, 0x603870, 0x703870, 0x703860, 0x703854, 0x703844, 0x703838, 0x704438, 0x705438, 0x706038, 0x707038, 0x607038, 0x547038, 0x447038, 0x387038, 0x387044, 0x387054, 0x387060, 0x387070, 0x386070, 0x385470, 0x384470, 0x505070, 0x585070, 0x605070, 0x685070, 0x705070, 0x705068, 0x705060, 0x705058, 0x705050, 0x705850, 0x706050, 0x706850, 0x707050, 0x687050, 0x607050, 0x587050, 0x507050, 0x507058, 0x507060, 0x507068, 0x507070, 0x506870, 0x506070, 0x505870, 0x000040, 0x100040, 0x200040, 0x300040, 0x400040, 0x400030, 0x400020, 0x400010, 0x400000, 0x401000, 0x402000, 0x403000, 0x404000, 0x304000, 0x204000, 0x104000, 0x004000, 0x004010, 0x004020, 0x004030, 0x004040, 0x003040, 0x002040, 0x001040, 0x202040, 0x282040, 0x302040, 0x382040, 0x402040, 0x402038, 0x402030, 0x402028, 0x402020, 0x402820, 0x403020, 0x403820, 0x404020, 0x384020, 0x304020, 0x284020, 0x204020, 0x204028, 0x204030, 0x204038, 0x204040, 0x203840, 0x203040, 0x202840, 0x2c2c40, 0x302c40, 0x342c40, 0x3c2c40, 0x402c40, 0x402c3c, 0x402c34, 0x402c30, 0x402c2c, 0x40302c, 0x40342c, 0x403c2c, 0x40402c, 0x3c402c, 0x34402c, 0x30402c, 0x2c402c, 0x2c4030, 0x2c4034, 0x2c403c, 0x2c4040, 0x2c3c40, 0x2c3440, 0x2c3040, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000 };
@@ -238,8 +268,13 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	bool locked;
+
+	if (serial_exists) {
+		locked = cons_lock();
 		cons_intr(serial_proc_data);
+		cons_unlock(locked);
+	}
 }
 
 static void
@@ -700,7 +735,10 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
+	bool locked = cons_lock();
+
 	cons_intr(kbd_proc_data);
+	cons_unlock(locked);
 }
 
 static void
@@ -747,6 +785,7 @@ int
 cons_getc(void)
 {
 	int c;
+	bool locked;
 
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
@@ -755,22 +794,70 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	locked = cons_lock();
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_unlock(locked);
+	return c;
+}
+
+// The envs that found no input in cons_getc_notify, to be sent
+// NOTIFY_CONS when some arrives: a bit per envs[] slot, and the envid
+// that set it.
+static volatile uint32_t cons_readers[NENV / 32];
+static volatile envid_t cons_reader_ids[NENV];
+
+// Like cons_getc, but if no input is waiting, arrange for env envid to be
+// sent NOTIFY_CONS once some arrives (by cons_notify).
+int
+cons_getc_notify(envid_t envid)
+{
+	// Publish envid before looking, so that input arriving from now on
+	// either shows up below or finds envid in cons_notify.
+	cons_reader_ids[ENVX(envid)] = envid;
+	test_and_set_bit(&cons_readers[ENVX(envid) / 32], ENVX(envid) % 32);
+	return cons_getc();
+}
+
+// Called from the keyboard and serial interrupt handlers, with no env
+// locked: send NOTIFY_CONS to every env waiting for input, if there is
+// input.  They race for it; the losers wait again.
+void
+cons_notify(void)
+{
+	struct Env *e;
+	uint32_t bits;
+	int i, j;
+
+	if (cons.rpos == cons.wpos)
+		return;
+	for (i = 0; i < NENV / 32; i++) {
+		if (!cons_readers[i])
+			continue;
+		bits = xchg(&cons_readers[i], 0);
+		for (j = 0; j < 32; j++)
+			if ((bits & (1U << j))
+			    && envid2env_lock(cons_reader_ids[i * 32 + j], &e, 0) == 0) {
+				env_notify(e, NOTIFY_CONS);
+				env_unlock(e);
+			}
+	}
 }
 
 // output a character to the console
 static void
 cons_putc(int c)
 {
+	bool locked = cons_lock();
+
 	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
+	cons_unlock(locked);
 }
 
 // initialize the console devices
@@ -7,6 +7,7 @@
 #endif
 
 #include <inc/types.h>
+#include <inc/env.h>
 #include <kern/paint.h>
 
 #define MONO_BASE	0x3B4
@@ -48,6 +49,8 @@
 
 void cons_init(void);
 int cons_getc(void);
+int cons_getc_notify(envid_t envid);
+void cons_notify(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
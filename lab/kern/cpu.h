@@ -10,6 +10,9 @@
 // Maximum number of CPUs
 #define NCPU  8
 
+// Size of a cache line, for keeping per-CPU data apart
+#define CACHELINE  64
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -17,13 +20,21 @@ enum {
 	CPU_HALTED,
 };
 
-// Per-CPU state
+// Per-CPU state.  Each CPU's entry sits on its own cache lines so that
+// one CPU updating its cpu_env or cpu_status doesn't bounce the line
+// another CPU is reading.
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // Points to itself; must stay first
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	volatile uint32_t cpu_user;     // Running, or about to run, in user mode
+	pde_t *volatile cpu_pgdir;      // User address space in %cr3, or NULL
+	volatile uint32_t cpu_tlbflush; // Invalidations in our mailbox (pmap.c)
+	struct PageInfo *cpu_pages;     // Free pages kept for this CPU (pmap.c)
+	uint32_t cpu_npages;            // Number of them
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
-};
+} __attribute__((aligned(CACHELINE)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -34,13 +45,27 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
+// cpunum() reads the LAPIC ID over MMIO; use it only where %gs may not
+// be set up yet.  Everything else should go through thiscpu.
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+
+// The current CPU's struct CpuInfo.  env_init_percpu() points %gs at a
+// segment based at this CPU's cpus[] entry, so this is a single
+// %gs-relative load of cpu_self.
+static inline struct CpuInfo *
+thiscpu_get(void)
+{
+	struct CpuInfo *c;
+	asm volatile("movl %%gs:0,%0" : "=r" (c));
+	return c;
+}
+#define thiscpu (thiscpu_get())
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
@@ -14,11 +14,27 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/region.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Protects env_free_list.
+static struct spinlock env_table_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_table_lock"
+#endif
+};
+
+// One lock per env, indexed like envs[].  An env's lock protects its
+// address space, its IPC state (including the queue of envs blocked
+// sending to it), its list of waiters and its liveness: an env is only
+// marked dying or freed with its lock held.  See kern/env.h for the
+// lock order.
+static struct spinlock env_locks[NENV];
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -36,7 +52,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2*NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +71,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_CPU0) are initialized
+	// in env_init_percpu()
+	[GD_CPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -108,6 +128,129 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+//
+// Lock two environments (which may be the same one), always taking the
+// one earlier in envs[] first so that two CPUs locking the same pair
+// cannot deadlock.
+//
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_lock(a);
+		return;
+	}
+	if (a > b) {
+		struct Env *t = a;
+		a = b;
+		b = t;
+	}
+	env_lock(a);
+	env_lock(b);
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (b != a)
+		env_unlock(b);
+}
+
+//
+// With e locked, check that e is still the environment envid2env found
+// for 'envid' (0 meaning curenv), and that it is not being destroyed.
+//
+bool
+env_alive(struct Env *e, envid_t envid)
+{
+	return (envid == 0 || e->env_id == envid)
+		&& e->env_status != ENV_FREE && e->env_status != ENV_DYING;
+}
+
+//
+// Like envid2env, but also locks the environment, making sure it was not
+// destroyed between the lookup and the locking.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	env_lock(e);
+	if (!env_alive(e, envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+//
+// Look up envid as envid2env does (without the permission check), and
+// lock it together with curenv.  On success, release both with
+// env_unlock_pair(curenv, *env_store); if envid is curenv itself, it is
+// only locked once.
+//
+int
+envid2env_lock_curenv(envid_t envid, struct Env **env_store)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	env_lock_pair(curenv, e);
+	if (!env_alive(e, envid)) {
+		env_unlock_pair(curenv, e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+//
+// e is locked, and *headp (protected by e's lock) is the head of a list
+// of other envs.  Lock that first env as well and return it, or return
+// NULL if the list is empty.  To respect the lock order e's lock may be
+// dropped and retaken meanwhile, but it is held again on return.
+//
+struct Env *
+env_lock_first(struct Env *e, struct Env **headp)
+{
+	struct Env *s;
+
+	while ((s = *headp) != NULL) {
+		if (s > e) {
+			env_lock(s);
+			return s;
+		}
+		env_unlock(e);
+		env_lock_pair(e, s);
+		if (*headp == s)
+			return s;
+		env_unlock(s);
+	}
+	return NULL;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -120,6 +263,7 @@ env_init(void)
 	// Set up envs array
 	// LAB 3: Your code here.
     for(int i=NENV-1;i>=0;i--){
+        __spin_initlock(&env_locks[i], "env_lock");
         envs[i].env_status = ENV_FREE;
         envs[i].env_id = 0;
         envs[i].env_link = env_free_list;
@@ -134,10 +278,23 @@ env_init(void)
 void
 env_init_percpu(void)
 {
+    int i = cpunum();
+    struct CpuInfo *c = &cpus[i];
+
+    static_assert(GD_CPU0 == GD_TSS0 + (NCPU << 3));
+    static_assert(offsetof(struct CpuInfo, cpu_self) == 0);
+
+    // This CPU's data segment is based at its cpus[] entry, so that
+    // thiscpu is just %gs:0.  It is DPL 0: the iret to user mode nulls
+    // %gs, and _alltraps reloads it on the way back in.
+    c->cpu_self = c;
+    gdt[(GD_CPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) c,
+                                    sizeof(struct CpuInfo) - 1, 0);
+
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_CPU0 + (i << 3)));
+	// The kernel never uses FS, so we leave it set to the user data
+	// segment.
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -156,7 +313,8 @@ env_init_percpu(void)
 // Allocate a page directory, set e->env_pgdir accordingly,
 // and initialize the kernel portion of the new environment's address space.
 // Do NOT (yet) map anything into the user portion
-// of the environment's virtual address space.
+// of the environment's virtual address space; just reserve the normal
+// user stack as a region, so that it grows on demand up to USTACKSIZE.
 //
 // Returns 0 on success, < 0 on error.  Errors include:
 //	-E_NO_MEM if page directory or table could not be allocated.
@@ -164,7 +322,7 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i;
+	int i, r;
 	struct PageInfo *p = NULL;
 
 	// Allocate a page for the page directory
@@ -188,7 +346,7 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 
 	// LAB 3: Your code here.
-    p->pp_ref++;
+    page_incref(p);
     e->env_pgdir=(pde_t*)page2kva(p);
     memcpy(e->env_pgdir,kern_pgdir,PGSIZE);
 
@@ -196,6 +354,12 @@ env_setup_vm(struct Env *e)
 	// Permissions: kernel R, user R
 	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
 
+	if ((r = region_reserve(e->env_pgdir, USTACKTOP - USTACKSIZE,
+				USTACKSIZE, PTE_P|PTE_U|PTE_W)) < 0) {
+		e->env_pgdir = NULL;
+		page_decref(p);
+		return r;
+	}
 	return 0;
 }
 
@@ -214,12 +378,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -228,11 +402,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_id = generation | (e - envs);
 
 	// Set the basic status variables.
-    e->priority = 0;
+    e->priority = e->env_base_priority = 0;
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = -1;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -261,12 +435,29 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and the send queues.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_ipc_recv_from = 0;
+	e->env_ipc_sendq = e->env_ipc_sendq_tail = NULL;
+	e->env_ipc_sendto = NULL;
+	e->env_ipc_calling = 0;
+	e->env_ipc_client = 0;
+
+	// Nobody is waiting for us yet.
+	e->env_exit_status = 0;
+	e->env_waiters = NULL;
+	e->env_wait_for = NULL;
+	e->env_futex_key = 0;
+	e->env_futex_pgdir = NULL;
+	e->env_futex_next = NULL;
+	e->env_futex_gen = 0;
+	e->env_notify = 0;
+	e->env_notify_mask = 0;
+
+	// The caller makes the new env runnable once it is set up.
+	e->env_status = ENV_NOT_RUNNABLE;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -406,10 +597,196 @@ env_create(uint8_t *binary, enum EnvType type)
     if(type==ENV_TYPE_FS){
         env->env_tf.tf_eflags |= FL_IOPL_MASK;
     }
+    env_lock(env);
+    sched_wakeup(env);
+    env_unlock(env);
+}
+
+//
+// Append src to the FIFO of environments blocked sending to dst.
+// The value, page and perm being sent must already be recorded in src.
+// Both envs must be locked.
+//
+void
+env_ipc_enqueue(struct Env *dst, struct Env *src)
+{
+	src->env_ipc_sendto = dst;
+	src->env_ipc_sendq_next = NULL;
+	if (dst->env_ipc_sendq_tail)
+		dst->env_ipc_sendq_tail->env_ipc_sendq_next = src;
+	else
+		dst->env_ipc_sendq = src;
+	dst->env_ipc_sendq_tail = src;
+}
+
+//
+// Remove and return the first environment blocked sending to dst,
+// or NULL if there is none.  dst and that env must be locked (see
+// env_lock_first).
+//
+struct Env *
+env_ipc_dequeue(struct Env *dst)
+{
+	struct Env *src;
+
+	if (!(src = dst->env_ipc_sendq))
+		return NULL;
+	if (!(dst->env_ipc_sendq = src->env_ipc_sendq_next))
+		dst->env_ipc_sendq_tail = NULL;
+	src->env_ipc_sendq_next = NULL;
+	src->env_ipc_sendto = NULL;
+	return src;
+}
+
+//
+// Recompute e's effective priority for priority inheritance along IPC:
+// e runs at the best (lowest) of its own base priority, the priority of
+// the caller it owes a reply to, and the priorities of every env queued
+// sending to it.  An improvement is passed on to whoever e is itself
+// blocked on, so chains of servers inherit too.
+//
+// e must be locked.  The envs further down the chain are not, so they
+// are only ever boosted here, never recomputed; a loan that ends is
+// settled when each of them next recomputes its own priority.
+//
+void
+env_inherit_priority(struct Env *e)
+{
+	struct Env *c, *s;
+	int prio;
+
+	prio = e->env_base_priority;
+	if (e->env_ipc_client && envid2env(e->env_ipc_client, &c, 0) == 0
+	    && c->priority < prio)
+		prio = c->priority;
+	for (s = e->env_ipc_sendq; s; s = s->env_ipc_sendq_next)
+		if (s->priority < prio)
+			prio = s->priority;
+	if (prio >= e->priority) {
+		e->priority = prio;
+		return;
+	}
+	e->priority = prio;
+
+	// Each step strictly lowers a priority to prio, so this stops
+	// even if the envs are blocked on each other in a cycle.
+	while ((e = env_ipc_blocked_on(e)) != NULL && prio < e->priority)
+		e->priority = prio;
+}
+
+//
+// The env e is waiting on in IPC: the one it is queued sending to, or the
+// server whose reply to its call it is waiting for.  NULL if none.
+//
+struct Env *
+env_ipc_blocked_on(struct Env *e)
+{
+	struct Env *s;
+
+	if (e->env_ipc_sendto)
+		return e->env_ipc_sendto;
+	if (e->env_ipc_recving && e->env_ipc_recv_from
+	    && envid2env(e->env_ipc_recv_from, &s, 0) == 0
+	    && s->env_ipc_client == e->env_id)
+		return s;
+	return NULL;
+}
+
+//
+// Take src off the send queue it is blocked on, if any.
+// Called with no env locked.
+//
+void
+env_ipc_unqueue(struct Env *src)
+{
+	struct Env *dst, **pp, *prev = NULL;
+
+	// Lock src together with the env it is queued on; that can change
+	// until we hold both.
+	for (;;) {
+		if (!(dst = src->env_ipc_sendto))
+			return;
+		env_lock_pair(src, dst);
+		if (src->env_ipc_sendto == dst)
+			break;
+		env_unlock_pair(src, dst);
+	}
+	for (pp = &dst->env_ipc_sendq; *pp; prev = *pp, pp = &(*pp)->env_ipc_sendq_next)
+		if (*pp == src) {
+			*pp = src->env_ipc_sendq_next;
+			if (dst->env_ipc_sendq_tail == src)
+				dst->env_ipc_sendq_tail = prev;
+			break;
+		}
+	src->env_ipc_sendq_next = NULL;
+	src->env_ipc_sendto = NULL;
+	env_inherit_priority(dst);
+	env_unlock_pair(src, dst);
+}
+
+//
+// Block the current environment until e is freed.
+// Both envs must be locked; the caller must give up the CPU afterwards.
+//
+void
+env_wait(struct Env *e)
+{
+	curenv->env_wait_for = e;
+	curenv->env_wait_next = e->env_waiters;
+	e->env_waiters = curenv;
+	sched_suspend(curenv);
+}
+
+//
+// Take e off the waiter list of the environment it is waiting for, if any.
+// Called with no env locked.
+//
+void
+env_wait_cancel(struct Env *e)
+{
+	struct Env **pp, *w;
+
+	for (;;) {
+		if (!(w = e->env_wait_for))
+			return;
+		env_lock_pair(e, w);
+		if (e->env_wait_for == w)
+			break;
+		env_unlock_pair(e, w);
+	}
+	for (pp = &w->env_waiters; *pp; pp = &(*pp)->env_wait_next)
+		if (*pp == e) {
+			*pp = e->env_wait_next;
+			break;
+		}
+	e->env_wait_next = NULL;
+	e->env_wait_for = NULL;
+	env_unlock_pair(e, w);
+}
+
+//
+// Send e the notification bits 'bits', waking it up if it is blocked in
+// sys_notify_wait on any of them; it then returns the bits it waited
+// for that are set, and they are cleared.  e must be locked.
+//
+void
+env_notify(struct Env *e, uint32_t bits)
+{
+	uint32_t ready;
+
+	e->env_notify |= bits;
+	if (!(ready = e->env_notify & e->env_notify_mask))
+		return;
+	e->env_notify &= ~ready;
+	e->env_notify_mask = 0;
+	e->env_tf.tf_regs.reg_eax = ready;
+	sched_wakeup(e);
 }
 
 //
 // Frees env e and all memory it uses.
+// e must already be marked ENV_DYING (see env_destroy), and no env may be
+// locked by the caller.
 //
 void
 env_free(struct Env *e)
@@ -417,24 +794,90 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct PageInfo *pp;
+	struct Env *s;
+	bool shared;
+	int i;
+
+	// Stop waiting to send or for anybody else's exit.  Nobody can
+	// start waiting on us from now on: env_alive fails for dying envs.
+	env_ipc_unqueue(e);
+	env_wait_cancel(e);
+	futex_cancel(e);
+
+	// Fail every call still waiting for our reply, and take back the
+	// priority we lent any server handling a call of ours.
+	for (i = 0; i < NENV; i++) {
+		s = &envs[i];
+		if (s == e || ((!s->env_ipc_recving || s->env_ipc_recv_from != e->env_id)
+			       && s->env_ipc_client != e->env_id))
+			continue;
+		env_lock_pair(e, s);
+		if (s->env_ipc_recving && s->env_ipc_recv_from == e->env_id) {
+			s->env_ipc_recving = 0;
+			s->env_ipc_recv_from = 0;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			sched_wakeup(s);
+		}
+		if (s->env_ipc_client == e->env_id) {
+			s->env_ipc_client = 0;
+			env_inherit_priority(s);
+		}
+		env_unlock_pair(e, s);
+	}
+
+	// Fail every send blocked on us, and tell our waiters we are gone.
+	env_lock(e);
+	while ((s = env_lock_first(e, &e->env_ipc_sendq)) != NULL) {
+		env_ipc_dequeue(e);
+		s->env_ipc_calling = 0;
+		s->env_ipc_recv_from = 0;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(s);
+		env_unlock(s);
+	}
+	while ((s = env_lock_first(e, &e->env_waiters)) != NULL) {
+		e->env_waiters = s->env_wait_next;
+		s->env_wait_next = NULL;
+		s->env_wait_for = NULL;
+		s->env_wait_status = e->env_exit_status;
+		s->env_tf.tf_regs.reg_eax = 0;
+		sched_wakeup(s);
+		env_unlock(s);
+	}
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(PADDR(kern_pgdir));
+		thiscpu->cpu_pgdir = NULL;
+	}
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// A thread leaves the address space to the threads still using it;
+	// only the last one out tears it down.
+	pgdir_lock(e->env_pgdir);
+	pp = pa2page(PADDR(e->env_pgdir));
+	shared = pp->pp_ref > 1;
+	if (shared)
+		page_decref(pp);
+	pgdir_unlock(e->env_pgdir);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	for (pdeno = 0; !shared && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// page tables still shared since fork just lose a sharer
+		if (pgdir_drop_shared(e->env_pgdir, pdeno))
+			continue;
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -450,15 +893,21 @@ env_free(struct Env *e)
 		page_decref(pa2page(pa));
 	}
 
-	// free the page directory
+	// free the page directory, and the regions recorded for it
 	pa = PADDR(e->env_pgdir);
+	if (!shared)
+		region_free(e->env_pgdir);
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	if (!shared)
+		page_decref(pa2page(pa));
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
+	env_unlock(e);
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -469,14 +918,40 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	env_lock(e);
+	env_destroy_locked(e);
+}
+
+//
+// Like env_destroy, but called with e locked (e.g. by envid2env_lock),
+// so that e cannot be replaced by a new env in between.
+// Releases e's lock.
+//
+void
+env_destroy_locked(struct Env *e)
+{
+	bool free_now;
+
+	// If e is currently running on another CPU, we change its state to
+	// ENV_DYING and leave it to that CPU: a zombie environment is freed
+	// the next time it traps to the kernel or its CPU switches away
+	// from it.  Otherwise we mark it dying, so that no CPU picks it up,
+	// and free it ourselves.  A dying env not held by this CPU is
+	// already being freed by someone else.
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_FREE
+	    || (e->env_status == ENV_DYING && e->env_cpunum != thiscpu->cpu_id)) {
+		spin_unlock(&sched_lock);
+		env_unlock(e);
 		return;
 	}
+	free_now = e->env_cpunum < 0 || e->env_cpunum == thiscpu->cpu_id;
+	e->env_status = ENV_DYING;
+	spin_unlock(&sched_lock);
+	env_unlock(e);
 
+	if (!free_now)
+		return;
 	env_free(e);
 
 	if (curenv == e) {
@@ -495,9 +970,7 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-
+	tlb_leave_kernel();
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
@@ -536,14 +1009,30 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-    if(curenv&&curenv->env_status==ENV_RUNNING){
-        curenv->env_status=ENV_RUNNABLE;
+    // The status and address space switch happen under sched_lock, so
+    // that the env we leave cannot be freed while its page directory is
+    // still loaded here.  env_cpunum records the CPU holding e (also
+    // read by user space for debugging).
+    struct Env *zombie = NULL;
+
+    spin_lock(&sched_lock);
+    if(curenv!=e){
+        zombie=sched_release(curenv);
+    }
+    if(e->env_status==ENV_RUNNABLE){
+        e->env_status=ENV_RUNNING;
     }
+    e->env_cpunum=thiscpu->cpu_id;
     curenv=e;
-    curenv->env_status=ENV_RUNNING;
     curenv->env_runs++;
+    // Tell tlb_flush before loading it, so that it misses no change.
+    thiscpu->cpu_pgdir = curenv->env_pgdir;
+    // Flushes the user half of the TLB only; see boot_map_region.
     lcr3(PADDR(curenv->env_pgdir));
-    unlock_kernel();
+    spin_unlock(&sched_lock);
+
+    if(zombie){
+        env_free(zombie);
+    }
     env_pop_tf(&curenv->env_tf);
 }
-
@@ -16,8 +16,43 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy_locked(struct Env *e);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+
+// Locking.  There is no big kernel lock; instead each env has a lock of
+// its own, taken with env_lock, or with env_lock_pair when an operation
+// (IPC, page_map, wait) involves two envs.  Locks are always acquired
+// in this order, and never held across a context switch:
+//
+//	env locks (lower envs[] index first)
+//	  -> pgdir locks -> futex and region bucket locks
+//	  -> env_table_lock -> sched_lock -> pt_lock -> kmem_lock
+//	  -> tlb_hold_lock -> page_lock -> vga_lock
+//
+// The TLB mailbox locks (kern/pmap.c) are leaves like page_lock.
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
+bool	env_alive(struct Env *e, envid_t envid);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock_curenv(envid_t envid, struct Env **env_store);
+struct Env *env_lock_first(struct Env *e, struct Env **headp);
+
+// Queue of environments blocked in sys_ipc_send
+void	env_ipc_enqueue(struct Env *dst, struct Env *src);
+struct Env *env_ipc_dequeue(struct Env *dst);
+void	env_ipc_unqueue(struct Env *src);
+void	env_inherit_priority(struct Env *e);
+struct Env *env_ipc_blocked_on(struct Env *e);
+
+// Exit notification
+void	env_wait(struct Env *e);
+void	env_wait_cancel(struct Env *e);
+
+// Notifications
+void	env_notify(struct Env *e, uint32_t bits);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
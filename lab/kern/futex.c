@@ -0,0 +1,170 @@
+// Futexes: sleeping in the kernel until a word of user memory changes.
+//
+// A futex is named by a key.  A word in a PTE_SHARE page is named by its
+// physical address, so the envs sharing the page meet on the same futex
+// whatever address they map it at.  Any other word is named by its
+// address space and its virtual address, with bit 0 set (words are
+// 4-byte aligned, so keys are never 0 and the two kinds never clash):
+// a write may move a copy-on-write page to another physical page, but
+// the threads of the address space keep finding the word where it was.
+
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/futex.h>
+
+// Waiters hang off buckets hashed by key page (and address space), so
+// that all the waiters on one physical page (see futex_unmapped) share a
+// bucket.  A waiter sits on its bucket's list, with env_futex_key and
+// env_futex_pgdir set, from futex_wait until it is woken or cancelled.
+#define NFUTEXBUCKET	64
+
+struct FutexBucket {
+	struct spinlock fb_lock;
+	struct Env *fb_waiters;		// In the order they went to sleep
+};
+
+static struct FutexBucket futex_buckets[NFUTEXBUCKET] = {
+#ifdef DEBUG_SPINLOCK
+	[0 ... NFUTEXBUCKET - 1] = { .fb_lock = { .name = "futex_lock" } }
+#endif
+};
+
+// Bumped whenever a PTE_SHARE mapping is removed; see futex_wait.
+volatile uint32_t futex_unmap_gen;
+
+static struct FutexBucket *
+futex_bucket(pde_t *pgdir, uintptr_t key)
+{
+	uint32_t h = PGNUM(key);
+
+	if (pgdir)
+		h += PGNUM(PADDR(pgdir));
+	return &futex_buckets[h % NFUTEXBUCKET];
+}
+
+//
+// Put curenv to sleep on the futex named by pgdir (NULL for a physical
+// address) and key, provided the word, at kernel address word, still
+// holds expected, and no PTE_SHARE mapping has been removed since
+// futex_unmap_gen was gen (as of curenv's previous system call).  The
+// latter lets users of pageref(), like pipes, check that the other side
+// is still there and then sleep, without missing it going away in
+// between.
+//
+// curenv must be locked, and so must its page directory, so that word
+// stays mapped.  On success, the caller must give up the CPU; curenv
+// then returns 0 from its system call once woken.
+//
+// RETURNS:
+//   0 on success
+//   -E_AGAIN, if the word no longer holds expected, or a mapping went
+//             away
+//
+int
+futex_wait(pde_t *pgdir, uintptr_t key, volatile uint32_t *word,
+	   uint32_t expected, uint32_t gen)
+{
+	struct FutexBucket *b = futex_bucket(pgdir, key);
+	struct Env **pp;
+
+	spin_lock(&b->fb_lock);
+	if (*word != expected || gen != futex_unmap_gen) {
+		spin_unlock(&b->fb_lock);
+		return -E_AGAIN;
+	}
+	for (pp = &b->fb_waiters; *pp; pp = &(*pp)->env_futex_next)
+		;
+	*pp = curenv;
+	curenv->env_futex_next = NULL;
+	curenv->env_futex_pgdir = pgdir;
+	curenv->env_futex_key = key;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	// Suspend before a waker can see us, so that no wakeup is lost.
+	sched_suspend(curenv);
+	spin_unlock(&b->fb_lock);
+	return 0;
+}
+
+// Wake up to n envs waiting on a futex of pgdir whose key, masked with
+// mask, is key.  Returns the number woken.
+static int
+futex_wake_match(pde_t *pgdir, uintptr_t key, uintptr_t mask, int n)
+{
+	struct FutexBucket *b = futex_bucket(pgdir, key);
+	struct Env **pp, *w;
+	int woken = 0;
+
+	spin_lock(&b->fb_lock);
+	for (pp = &b->fb_waiters; (w = *pp) && woken < n; ) {
+		if (w->env_futex_pgdir != pgdir
+		    || (w->env_futex_key & mask) != key) {
+			pp = &w->env_futex_next;
+			continue;
+		}
+		*pp = w->env_futex_next;
+		w->env_futex_next = NULL;
+		w->env_futex_pgdir = NULL;
+		w->env_futex_key = 0;
+		// While on our list w cannot be freed (env_free cancels its
+		// wait first), so the bucket lock stands in for w's lock.
+		sched_wakeup(w);
+		woken++;
+	}
+	spin_unlock(&b->fb_lock);
+	return woken;
+}
+
+// Wake up to n envs waiting on the futex named by pgdir and key, in the
+// order they went to sleep.  Returns the number woken.
+int
+futex_wake(pde_t *pgdir, uintptr_t key, int n)
+{
+	return futex_wake_match(pgdir, key, ~0, n);
+}
+
+// Take e off the futex it is waiting on, if any.  Called with no env
+// locked, by e itself or on e's way out.
+void
+futex_cancel(struct Env *e)
+{
+	struct FutexBucket *b;
+	struct Env **pp;
+	pde_t *pgdir;
+	uintptr_t key;
+
+	for (;;) {
+		pgdir = e->env_futex_pgdir;
+		if (!(key = e->env_futex_key))
+			return;
+		b = futex_bucket(pgdir, key);
+		spin_lock(&b->fb_lock);
+		if (e->env_futex_key == key && e->env_futex_pgdir == pgdir)
+			break;
+		spin_unlock(&b->fb_lock);
+	}
+	for (pp = &b->fb_waiters; *pp; pp = &(*pp)->env_futex_next)
+		if (*pp == e) {
+			*pp = e->env_futex_next;
+			break;
+		}
+	e->env_futex_next = NULL;
+	e->env_futex_pgdir = NULL;
+	e->env_futex_key = 0;
+	spin_unlock(&b->fb_lock);
+}
+
+// A PTE_SHARE mapping of the page at pa has just been removed: wake
+// everyone waiting on a futex in that page, so that they can look at
+// who is left (see futex_wait).
+void
+futex_unmapped(physaddr_t pa)
+{
+	xadd(&futex_unmap_gen, 1);
+	futex_wake_match(NULL, PTE_ADDR(pa), PTE_ADDR(~0), NENV);
+}
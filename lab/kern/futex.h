@@ -0,0 +1,22 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+struct Env;
+
+extern volatile uint32_t futex_unmap_gen;
+
+int	futex_wait(pde_t *pgdir, uintptr_t key, volatile uint32_t *word,
+		   uint32_t expected, uint32_t gen);
+int	futex_wake(pde_t *pgdir, uintptr_t key, int n);
+void	futex_cancel(struct Env *e);
+void	futex_unmapped(physaddr_t pa);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -7,6 +7,7 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -21,6 +22,10 @@ static void boot_aps(void);
 void
 i386_init(void)
 {
+	// Load the GDT and this CPU's %gs segment first: thiscpu, and so
+	// every spinlock, depends on it.
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -29,6 +34,7 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -41,13 +47,6 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-    lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -59,6 +58,11 @@ i386_init(void)
 	ENV_CREATE(user_icode, ENV_TYPE_USER);
 #endif // TEST*
 
+	// Starting non-boot CPUs.  There is no big kernel lock to keep them
+	// out of the scheduler, so do this only once the first envs exist,
+	// lest an AP find nothing to run and drop into the monitor.
+	boot_aps();
+
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
@@ -85,7 +89,7 @@ boot_aps(void)
 
 	// Boot each AP one at a time
 	for (c = cpus; c < cpus + ncpu; c++) {
-		if (c == cpus + cpunum())  // We've started already.
+		if (c == thiscpu)  // We've started already.
 			continue;
 
 		// Tell mpentry.S what stack to use 
@@ -103,20 +107,19 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
-	cprintf("SMP: CPU %d starting\n", cpunum());
+	// Before anything that takes a lock: that needs thiscpu.
+	env_init_percpu();
+	cprintf("SMP: CPU %d starting\n", thiscpu->cpu_id);
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-    lock_kernel();
+	// to start running processes on this CPU.  The scheduler does its
+	// own locking, so several CPUs may be in it at once.
     sched_yield();
 
 	// Remove this after you finish Exercise 6
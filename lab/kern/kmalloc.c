@@ -0,0 +1,297 @@
+// Kernel heap: kmalloc and kfree, for objects of any size.
+//
+// Objects of up to KMEM_MAXSIZE bytes come from slab caches, one per
+// power of two from KMEM_MINSIZE up.  A slab is a page holding a struct
+// Slab followed by objects of one size.  Larger objects get a block of
+// their own from page_alloc_order; kfree tells the two apart because
+// only those are page-aligned.
+//
+// Each CPU keeps a magazine of up to KMEM_MAG free objects per cache,
+// which it allocates from and frees to without any lock, since the
+// kernel runs with interrupts off.  Objects move between a magazine and
+// the cache's slabs KMEM_MAG / 2 at a time, under the cache's lock.
+
+#include <inc/assert.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+
+#define KMEM_MINSIZE	16
+#define KMEM_MAXSIZE	1024
+#define NKMEMCACHE	7		// KMEM_MINSIZE << i, up to KMEM_MAXSIZE
+#define KMEM_MAG	16
+
+struct KmemCache;
+
+struct Slab {
+	struct KmemCache *sl_cache;
+	struct Slab *sl_prev;		// On the cache's list of slabs with
+	struct Slab *sl_next;		//   free objects
+	void *sl_free;			// Free objects, linked by their first word
+	int sl_inuse;			// Objects not on sl_free
+};
+
+#define SLABHDR		ROUNDUP(sizeof(struct Slab), 16)
+
+// One CPU's magazine, on cache lines of its own.
+struct KmemMag {
+	int km_n;
+	void *km_objs[KMEM_MAG];
+	uint32_t km_allocs;		// Statistics
+	uint32_t km_frees;
+} __attribute__((aligned(CACHELINE)));
+
+struct KmemCache {
+	struct spinlock kc_lock;	// Protects the slabs
+	size_t kc_size;			// Object size
+	int kc_perslab;			// Objects per slab
+	struct Slab *kc_partial;	// Slabs with free objects
+	uint32_t kc_slabs;		// Slabs allocated
+	struct KmemMag kc_mags[NCPU];
+};
+
+static struct KmemCache kmem_caches[NKMEMCACHE] = {
+#ifdef DEBUG_SPINLOCK
+	[0 ... NKMEMCACHE - 1] = { .kc_lock = { .name = "kmem_lock" } }
+#endif
+};
+
+// Objects too big for a cache.
+static volatile uint32_t kmem_large_allocs, kmem_large_pages;
+
+static void check_kmalloc(void);
+
+void
+kmem_init(void)
+{
+	struct KmemCache *kc;
+	int i;
+
+	static_assert(KMEM_MINSIZE << (NKMEMCACHE - 1) == KMEM_MAXSIZE);
+	for (i = 0; i < NKMEMCACHE; i++) {
+		kc = &kmem_caches[i];
+		kc->kc_size = KMEM_MINSIZE << i;
+		kc->kc_perslab = (PGSIZE - SLABHDR) / kc->kc_size;
+	}
+	check_kmalloc();
+}
+
+// Unlink slab sl from its cache's partial list.  kc_lock must be held.
+static void
+slab_unlink(struct KmemCache *kc, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		kc->kc_partial = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_prev = sl->sl_next = NULL;
+}
+
+// Put slab sl on its cache's partial list.  kc_lock must be held.
+static void
+slab_link(struct KmemCache *kc, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	if ((sl->sl_next = kc->kc_partial) != NULL)
+		sl->sl_next->sl_prev = sl;
+	kc->kc_partial = sl;
+}
+
+// Make a new, empty slab for kc and put it on the partial list.
+// Returns NULL if out of memory.  kc_lock must be held.
+static struct Slab *
+slab_create(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if ((pp = page_alloc(0)) == NULL)
+		return NULL;
+	sl = page2kva(pp);
+	sl->sl_cache = kc;
+	sl->sl_inuse = 0;
+	sl->sl_free = NULL;
+	for (i = kc->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *) sl + SLABHDR + i * kc->kc_size;
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	slab_link(kc, sl);
+	kc->kc_slabs++;
+	return sl;
+}
+
+// Refill magazine m from kc's slabs.  Returns the number of objects now
+// in m.
+static int
+kmem_refill(struct KmemCache *kc, struct KmemMag *m)
+{
+	struct Slab *sl;
+	void *obj;
+
+	spin_lock(&kc->kc_lock);
+	while (m->km_n < KMEM_MAG / 2) {
+		if (!(sl = kc->kc_partial) && !(sl = slab_create(kc)))
+			break;
+		obj = sl->sl_free;
+		sl->sl_free = *(void **) obj;
+		if (++sl->sl_inuse == kc->kc_perslab)
+			slab_unlink(kc, sl);
+		m->km_objs[m->km_n++] = obj;
+	}
+	spin_unlock(&kc->kc_lock);
+	return m->km_n;
+}
+
+// Return half of the full magazine m to kc's slabs, freeing any slab
+// that empties, unless it is the only one left with free objects.
+static void
+kmem_drain(struct KmemCache *kc, struct KmemMag *m)
+{
+	struct Slab *sl;
+	void *obj;
+
+	spin_lock(&kc->kc_lock);
+	while (m->km_n > KMEM_MAG / 2) {
+		obj = m->km_objs[--m->km_n];
+		sl = ROUNDDOWN(obj, PGSIZE);
+		if (sl->sl_inuse-- == kc->kc_perslab)
+			slab_link(kc, sl);
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+		if (sl->sl_inuse == 0 && (sl->sl_prev || sl->sl_next)) {
+			slab_unlink(kc, sl);
+			kc->kc_slabs--;
+			page_free(pa2page(PADDR(sl)));
+		}
+	}
+	spin_unlock(&kc->kc_lock);
+}
+
+//
+// Allocate size bytes of kernel memory, aligned to 16 bytes (or to a
+// page, beyond KMEM_MAXSIZE).  If (alloc_flags & ALLOC_ZERO), clears it.
+// Returns NULL if out of memory, or if size is 0.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmemCache *kc;
+	struct KmemMag *m;
+	struct PageInfo *pp;
+	void *obj;
+	int i;
+
+	if (size == 0)
+		return NULL;
+	if (size > KMEM_MAXSIZE) {
+		for (i = 0; (PGSIZE << i) < size; i++)
+			;
+		if ((pp = page_alloc_order(i, alloc_flags)) == NULL)
+			return NULL;
+		// Not a free block, so the buddy allocator ignores pp_order
+		// until kfree gives it back.
+		pp->pp_order = i;
+		xadd(&kmem_large_allocs, 1);
+		xadd(&kmem_large_pages, 1 << i);
+		return page2kva(pp);
+	}
+
+	for (i = 0; (KMEM_MINSIZE << i) < size; i++)
+		;
+	kc = &kmem_caches[i];
+	m = &kc->kc_mags[thiscpu->cpu_id];
+	if (m->km_n == 0 && kmem_refill(kc, m) == 0)
+		return NULL;
+	obj = m->km_objs[--m->km_n];
+	m->km_allocs++;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, kc->kc_size);
+	return obj;
+}
+
+//
+// Free p, returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct KmemCache *kc;
+	struct KmemMag *m;
+	struct PageInfo *pp;
+
+	if (p == NULL)
+		return;
+	if (PGOFF(p) == 0) {
+		pp = pa2page(PADDR(p));
+		xadd(&kmem_large_allocs, -1);
+		xadd(&kmem_large_pages, -(1 << pp->pp_order));
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	kc = ((struct Slab *) ROUNDDOWN(p, PGSIZE))->sl_cache;
+	assert(kc >= kmem_caches && kc < kmem_caches + NKMEMCACHE);
+	m = &kc->kc_mags[thiscpu->cpu_id];
+	if (m->km_n == KMEM_MAG)
+		kmem_drain(kc, m);
+	m->km_objs[m->km_n++] = p;
+	m->km_frees++;
+}
+
+//
+// Print, for each cache, the slabs it holds, the objects in use, and
+// how many allocations it has served.
+//
+void
+kmem_print(void)
+{
+	struct KmemCache *kc;
+	uint32_t allocs, frees;
+	int i;
+
+	cprintf(" size  slabs  in use   allocs\n");
+	for (kc = kmem_caches; kc < kmem_caches + NKMEMCACHE; kc++) {
+		allocs = frees = 0;
+		for (i = 0; i < NCPU; i++) {
+			allocs += kc->kc_mags[i].km_allocs;
+			frees += kc->kc_mags[i].km_frees;
+		}
+		cprintf("%5u  %5u  %6u  %7u\n", kc->kc_size, kc->kc_slabs,
+			allocs - frees, allocs);
+	}
+	cprintf("large  %u objects in %u pages\n", kmem_large_allocs,
+		kmem_large_pages);
+}
+
+static void
+check_kmalloc(void)
+{
+	char *p[KMEM_MAG * 3], *big;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		assert((p[i] = kmalloc(1 + i * 7, ALLOC_ZERO)));
+		assert(PGOFF(p[i]) % 16 == 0 && p[i][i * 7] == 0);
+		memset(p[i], i, 1 + i * 7);
+	}
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		assert(p[i][0] == (char) i && p[i][i * 7] == (char) i);
+		kfree(p[i]);
+	}
+	assert(!kmalloc(0, 0));
+	assert((big = kmalloc(3 * PGSIZE, 0)) && PGOFF(big) == 0);
+	assert(pa2page(PADDR(big))->pp_order == 2);
+	kfree(big);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
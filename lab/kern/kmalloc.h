@@ -0,0 +1,16 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+void	kmem_init(void);
+void *	kmalloc(size_t size, int alloc_flags);
+void	kfree(void *p);
+void	kmem_print(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -11,6 +11,9 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,6 +28,9 @@ struct Command {
 int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_showvmrange(int argc, char **argv, struct Trapframe *tf);
 int mon_setperm(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf);
 
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
@@ -32,7 +38,10 @@ static struct Command commands[] = {
     { "backtrace", "Trace function calls", mon_backtrace},
     { "showmappings", "Show mapping information", mon_showmappings},
     { "showvmrange", "Show a range of virtual memory", mon_showvmrange},
-    { "setperm", "Set permission of a page", mon_setperm}
+    { "setperm", "Set permission of a page", mon_setperm},
+    { "lockstat", "Show spinlock contention statistics ('lockstat reset' clears them)", mon_lockstat},
+    { "buddyinfo", "Show free memory by block size", mon_buddyinfo},
+    { "kmeminfo", "Show kernel heap usage by object size", mon_kmeminfo}
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -90,7 +99,7 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf){
             cprintf("show mappings: page not found\n");
             return 0;
         }
-        cprintf("physical page %08x ",PTE_ADDR(*pte));
+        cprintf("physical page %08x ",pte_pa(pte,(void*)now));
         uint32_t p=(*pte)&PTE_P;
         uint32_t w=(*pte)&PTE_W;
         uint32_t u=(*pte)&PTE_U;
@@ -138,6 +147,25 @@ int mon_setperm(int argc, char **argv, struct Trapframe *tf){
     return 0;
 }
 
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf){
+    if(argc==2&&strcmp(argv[1],"reset")==0){
+        lockstat_reset();
+        return 0;
+    }
+    lockstat_print();
+    return 0;
+}
+
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf){
+    page_buddy_print();
+    return 0;
+}
+
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf){
+    kmem_print();
+    return 0;
+}
+
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
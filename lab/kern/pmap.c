@@ -10,6 +10,9 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/region.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +21,111 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *page_free_list;	// Free pages, while booting
+
+// Free physical memory is managed by a buddy allocator: a free block of
+// 2^order pages starts at a page number that is a multiple of 2^order,
+// and is headed by that page, which is on page_free_area[order] (linked
+// through pp_link and pp_prev) with pp_free set.  Freeing a block merges
+// it with its buddy, the other half of the block twice its size, for as
+// long as the buddy is free too.
+//
+// Until mem_init's checks, which walk and steal page_free_list, are
+// done, free pages are simply kept on page_free_list; page_buddy_init
+// then moves them into the buddy allocator.
+//
+// page_lock protects the free areas and every pp_ref, so that envs on
+// different CPUs can allocate, map and unmap pages at the same time.
+// This is a leaf lock: nothing else is acquired while holding it.
+//
+// Each CPU also keeps up to PAGECACHE free pages of its own (cpu_pages),
+// which it allocates from and frees to without any lock, since the
+// kernel runs with interrupts off.  They move to and from the buddy
+// allocator PAGEBATCH at a time, so at most NCPU * PAGECACHE free pages
+// are out of reach of other CPUs.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+static struct PageInfo *page_free_area[MAXORDER + 1];
+static uint32_t page_free_blocks[MAXORDER + 1];
+static bool page_buddy_on;
+#define PAGECACHE	32
+#define PAGEBATCH	16
+
+// Free pages already filled with zeroes by page_prezero, up to
+// PAGEZEROED of them.  Protected by page_lock.
+#define PAGEZEROED	256
+static struct PageInfo *page_zeroed_list;
+static volatile uint32_t page_nzeroed;
+
+// Protects page tables shared between address spaces since fork (see
+// pgdir_fork): their reference counts and their entries.  Taken after
+// env and pgdir locks and before page_lock.
+static struct spinlock pt_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "pt_lock"
+#endif
+};
+
+// Serialize changes to an address space.  The owning env's lock used to
+// be enough, but threads (see sys_thread_create) are envs sharing one
+// page directory.  Striped by page directory; taken after env locks.
+#define NPGDIRLOCK	16
+static struct spinlock pgdir_locks[NPGDIRLOCK];
+
+// TLB shootdowns (see tlb_flush).  Each CPU batches up the invalidations
+// of the operation it is doing on a shared address space, and holds on
+// to the pages unmapped meanwhile, one entry per reference, until it
+// passes the invalidations on to the other CPUs.  Up to TLBBATCH pages
+// are invalidated one by one; beyond that, it is cheaper to flush the
+// whole TLB.  A batch holding TLBHOLD references is sent early.
+#define TLBBATCH	16
+#define TLBHOLD		32
+
+struct TlbBatch {
+	pde_t *tb_pgdir;		// Address space of the batch, or NULL
+	int tb_n;			// Pages to invalidate; > TLBBATCH for all
+	uintptr_t tb_va[TLBBATCH];
+	int tb_nheld;			// References to drop once sent
+	struct PageInfo *tb_held[TLBHOLD];
+};
+static struct TlbBatch tlb_batches[NCPU];
+
+// Invalidations other CPUs asked this one to do.  cpu_tlbflush is set
+// while there are any.
+struct TlbMailbox {
+	struct spinlock tm_lock;
+	int tm_n;			// Pages to invalidate; > TLBBATCH for all
+	uintptr_t tm_va[TLBBATCH];
+	uint32_t tm_epoch;		// Oldest shootdown among them, or 0
+};
+static struct TlbMailbox tlb_mailboxes[NCPU] = {
+#ifdef DEBUG_SPINLOCK
+	[0 ... NCPU - 1] = { .tm_lock = { .name = "tlb_lock" } }
+#endif
+};
+
+// Every shootdown gets the next epoch (never 0).  Pages unmapped by one
+// that some CPU has yet to take wait on tlb_held, linked through pp_link,
+// until every mailbox is past their pp_hold_epoch.  tlb_hold_lock guards
+// the list and the pages' pp_hold fields; it is taken before page_lock,
+// and the mailbox locks are taken inside it.
+static uint32_t tlb_epoch;
+static struct PageInfo *volatile tlb_held;
+static struct spinlock tlb_hold_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "tlb_hold_lock"
+#endif
+};
+#define EPOCH_BEFORE(a, b)	((int32_t) ((a) - (b)) < 0)
+
+// Whether boot_map_region may use 4MB pages (CR4_PSE), and global pages
+// (CR4_PGE); set by mem_init if the CPU has them.
+#define CPUID_PSE	(1 << 3)	// cpuid(1) %edx: page size extensions
+#define CPUID_PGE	(1 << 13)	// cpuid(1) %edx: global pages
+static bool pse_on, pge_on;
 
 
 // --------------------------------------------------------------
@@ -65,6 +172,8 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_buddy_init(void);
+static void check_buddy(void);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -127,7 +236,7 @@ void
 mem_init(void)
 {
         cprintf("mem init\n");
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
@@ -179,6 +288,14 @@ mem_init(void)
 	check_page_alloc();
 	check_page();
 
+	// Map the big static regions below with 4MB pages where they are
+	// aligned for it: fewer page tables and far fewer TLB entries.  And
+	// make them global, so that switching address spaces keeps them.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse_on = (edx & CPUID_PSE) != 0;
+	pge_on = (edx & CPUID_PGE) != 0;
+	mem_init_percpu();
+
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
@@ -273,6 +390,20 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	page_buddy_init();
+	check_buddy();
+}
+
+// Turn on the paging features kern_pgdir relies on.  Each CPU calls this
+// before loading kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	if (pse_on)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_on)
+		lcr4(rcr4() | CR4_PGE);
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -372,6 +503,153 @@ page_init(void)
 	}
 }
 
+// Take the free block headed by pp off its free area.  page_lock must
+// be held.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	int order = pp->pp_order;
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+	page_free_blocks[order]--;
+}
+
+// Put the block of 2^order pages at pp on page_free_area[order].
+// page_lock must be held.
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	if ((pp->pp_link = page_free_area[order]) != NULL)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+	page_free_blocks[order]++;
+}
+
+// Allocate a block of 2^order pages, splitting a larger one if need be.
+// Returns NULL if there is no free block that large.  page_lock must be
+// held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= MAXORDER && !page_free_area[o]; o++)
+		;
+	if (o > MAXORDER)
+		return NULL;
+	pp = page_free_area[o];
+	buddy_remove(pp);
+	// Give back the upper halves we don't need.
+	while (o > order) {
+		o--;
+		buddy_insert(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages at pp, merging it with its buddies.
+// page_lock must be held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t pn = pp - pages, buddy;
+
+	while (order < MAXORDER) {
+		buddy = pn ^ (1 << order);
+		if (buddy >= npages || !pages[buddy].pp_free
+		    || pages[buddy].pp_order != order)
+			break;
+		buddy_remove(&pages[buddy]);
+		pn &= ~(1 << order);
+		order++;
+	}
+	buddy_insert(&pages[pn], order);
+}
+
+// Move the free pages mem_init left on page_free_list into the buddy
+// allocator, and start using it and the per-CPU caches.
+static void
+page_buddy_init(void)
+{
+	struct PageInfo *pp, *next;
+
+	spin_lock(&page_lock);
+	for (pp = page_free_list; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	page_free_list = NULL;
+	page_buddy_on = 1;
+	spin_unlock(&page_lock);
+}
+
+// Take a page off this CPU's cache or out of the buddy allocator.
+static struct PageInfo *
+page_take(void)
+{
+    struct CpuInfo *c = thiscpu;
+    struct PageInfo *first_page, *pp;
+    int n;
+
+    if(!page_buddy_on){
+        spin_lock(&page_lock);
+        if((first_page = page_free_list) != NULL){
+            page_free_list = first_page->pp_link;
+            first_page->pp_link = NULL;
+        }
+        spin_unlock(&page_lock);
+        return first_page;
+    }
+    if(c->cpu_npages){
+        // Common case: no lock, and likely a page this CPU freed lately.
+        first_page = c->cpu_pages;
+        c->cpu_pages = first_page->pp_link;
+        c->cpu_npages--;
+        first_page -> pp_link = NULL;
+        return first_page;
+    }
+    spin_lock(&page_lock);
+    first_page = buddy_alloc(0);
+    // Refill our cache while we hold the lock.
+    for(n = 1; first_page && n < PAGEBATCH && (pp = buddy_alloc(0)); n++){
+        pp->pp_link = c->cpu_pages;
+        c->cpu_pages = pp;
+        c->cpu_npages++;
+    }
+    spin_unlock(&page_lock);
+    return first_page;
+}
+
+// Take a page off page_zeroed_list, or return NULL if it is empty.
+static struct PageInfo *
+page_take_zeroed(void)
+{
+    struct PageInfo *pp;
+
+    if(page_nzeroed == 0)
+        return NULL;
+    spin_lock(&page_lock);
+    if((pp = page_zeroed_list) != NULL){
+        page_zeroed_list = pp->pp_link;
+        page_nzeroed--;
+        pp->pp_link = NULL;
+    }
+    spin_unlock(&page_lock);
+    return pp;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -388,18 +666,40 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-    if(page_free_list == NULL){
-        // No free page, just return NULL
-        return NULL;
+    struct PageInfo *pp;
+
+    // A page an idle CPU already cleared spares us the memset.
+    if((alloc_flags&ALLOC_ZERO) && (pp = page_take_zeroed()) != NULL)
+        return pp;
+    if((pp = page_take()) == NULL){
+        // Out of other pages; the zeroed ones are free pages too.
+        return page_take_zeroed();
     }
-    struct PageInfo * first_page = page_free_list;
     if (alloc_flags&ALLOC_ZERO){
-        memset(page2kva(first_page),0,PGSIZE);
+        memset(page2kva(pp),0,PGSIZE);
     }
-    struct PageInfo * nxt_page = first_page -> pp_link;
-    first_page -> pp_link = NULL;
-    page_free_list = nxt_page;
-	return first_page;
+	return pp;
+}
+
+//
+// Clear a free page and set it aside for page_alloc(ALLOC_ZERO), so that
+// the memset is off the allocating path.  Idle CPUs call this before
+// halting.  Returns 0 if the pool is full or there are no free pages.
+//
+bool
+page_prezero(void)
+{
+    struct PageInfo *pp;
+
+    if(page_nzeroed >= PAGEZEROED || (pp = page_take()) == NULL)
+        return 0;
+    memset(page2kva(pp),0,PGSIZE);
+    spin_lock(&page_lock);
+    pp->pp_link = page_zeroed_list;
+    page_zeroed_list = pp;
+    page_nzeroed++;
+    spin_unlock(&page_lock);
+    return 1;
 }
 
 //
@@ -412,14 +712,129 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
+    struct CpuInfo *c = thiscpu;
+    struct PageInfo *p, *cold;
+    int n;
+
     if(pp->pp_ref!=0){
         panic("Error: free a using page in page_free");
     }
-    if(pp->pp_link!=NULL){
+    if(pp->pp_link!=NULL || pp->pp_free){
         panic("Error: double-free a page in page_free");
     }
-    pp->pp_link=page_free_list;
-    page_free_list=pp;
+    if(!page_buddy_on){
+        spin_lock(&page_lock);
+        pp->pp_link=page_free_list;
+        page_free_list=pp;
+        spin_unlock(&page_lock);
+        return;
+    }
+    if(c->cpu_npages == PAGECACHE){
+        // Our cache is full: hand its coldest PAGEBATCH pages back.
+        for(n = 1, p = c->cpu_pages; n < PAGECACHE - PAGEBATCH; n++)
+            p = p->pp_link;
+        cold = p->pp_link;
+        p->pp_link = NULL;
+        c->cpu_npages -= PAGEBATCH;
+        spin_lock(&page_lock);
+        for(p = cold; p; p = cold){
+            cold = p->pp_link;
+            p->pp_link = NULL;
+            buddy_free(p, 0);
+        }
+        spin_unlock(&page_lock);
+    }
+    pp->pp_link = c->cpu_pages;
+    c->cpu_pages = pp;
+    c->cpu_npages++;
+}
+
+//
+// Allocate 2^order physically contiguous pages, the first of which is
+// aligned to 2^order pages.  If (alloc_flags & ALLOC_ZERO), clears them.
+// Like page_alloc, does not touch the reference counts.  The pages can
+// be freed all at once with page_free_order, or one at a time with
+// page_free or page_decref.
+//
+// Returns the first page's PageInfo, or NULL if no free block of that
+// size is left (or order > MAXORDER).
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > MAXORDER || !page_buddy_on)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Free the 2^order pages starting at pp, allocated by page_alloc_order.
+// All of their reference counts must be 0.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_free)
+			panic("page_free_order: page %d of the block is in use or free", i);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Print how free memory is split into blocks, and how much of it could
+// serve an allocation of each order.  Pages cached by CPUs and zeroed
+// pages count as free, but only for order 0.
+//
+void
+page_buddy_print(void)
+{
+	uint32_t blocks[MAXORDER + 1], nfree = 0, usable = 0;
+	int o, i;
+
+	spin_lock(&page_lock);
+	memcpy(blocks, page_free_blocks, sizeof(blocks));
+	spin_unlock(&page_lock);
+	for (o = 0; o <= MAXORDER; o++)
+		nfree += blocks[o] << o;
+	for (i = 0; i < ncpu; i++)
+		nfree += cpus[i].cpu_npages;
+	nfree += page_nzeroed;
+
+	cprintf("%u free pages of %u\n", nfree, npages);
+	cprintf("order  blocks  usable\n");
+	for (o = MAXORDER; o >= 0; o--) {
+		usable += blocks[o] << o;
+		cprintf("%5d  %6u  %5u%%\n", o, blocks[o],
+			nfree ? (o ? usable : nfree) * 100 / nfree : 0);
+	}
+}
+
+//
+// Increment the reference count on a page.
+//
+void
+page_incref(struct PageInfo* pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -429,7 +844,12 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	bool last;
+
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+	if (last)
 		page_free(pp);
 }
 
@@ -445,6 +865,10 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If 'va' lies in a 4MB page (see boot_map_region), there is no page
+// table, and pgdir_walk returns a pointer to the PDE itself; use pte_pa
+// to find the physical page it maps va to.
+//
 // Hint 1: you can turn a PageInfo * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -463,7 +887,15 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     uintptr_t la = (uintptr_t)va;
     uint32_t pdx = PDX(la), ptx = PTX(la);
     physaddr_t pg_2;//points to the second level page table
+    if(pgdir[pdx]&PTE_PS){
+        // A 4MB page has no page table: the PDE is the entry.
+        return &pgdir[pdx];
+    }
     if(pgdir[pdx]&PTE_P){//exists
+        // Creating means the caller is about to write the table, which
+        // must not be one still shared since fork.
+        if(create && (pgdir[pdx]&PTE_COW) && pgdir_unshare(pgdir,va)<0)
+            return NULL;
         pg_2 = PTE_ADDR(pgdir[pdx]);
         return (pte_t*)KADDR(pg_2)+ptx;
     }
@@ -473,7 +905,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
             if(new_pg==NULL){
                 return NULL;
             }
-            new_pg->pp_ref++;
+            page_incref(new_pg);
             pg_2 = page2pa(new_pg);
             pgdir[pdx] = pg_2 | PTE_P | PTE_W | PTE_U;
             return (pte_t*)KADDR(pg_2)+ptx;
@@ -496,15 +928,31 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // mapped pages.
 //
 // Hint: the TA solution uses pgdir_walk
+//
+// Where va and pa are both 4MB-aligned and at least 4MB remain, the
+// whole 4MB is mapped with a single large-page PDE (PTE_PS) instead,
+// if the CPU supports it.
+//
+// The mappings are the same in every address space, so they are made
+// global (PTE_G): lcr3 leaves them in the TLB.  Only invlpg drops them,
+// so a change to one must use tlb_invalidate (on every CPU), not lcr3.
+// User mappings are never global, as PTE_G is not in PTE_SYSCALL.
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
-    for(int i=0;i<size/PGSIZE;i++){
-        void* new_va=(void*)va+i*PGSIZE;
-        physaddr_t new_pa=pa+i*PGSIZE;
-        pte_t* new_pg=pgdir_walk(pgdir,new_va,1);
-        *new_pg=new_pa|perm|PTE_P;
+    if(pge_on)
+        perm|=PTE_G;
+    // Count size down rather than va up: the KERNBASE mapping ends at 2^32.
+    while(size>0){
+        if(pse_on && size>=PTSIZE && va%PTSIZE==0 && pa%PTSIZE==0){
+            pgdir[PDX(va)]=pa|perm|PTE_P|PTE_PS;
+            va+=PTSIZE, pa+=PTSIZE, size-=PTSIZE;
+            continue;
+        }
+        pte_t* new_pg=pgdir_walk(pgdir,(void*)va,1);
+        *new_pg=pa|perm|PTE_P;
+        va+=PGSIZE, pa+=PGSIZE, size-=PGSIZE;
     }
 }
 
@@ -539,14 +987,217 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	// Fill this function in
     pte_t *pte = pgdir_walk(pgdir,va,1);
     if(pte==NULL) return -E_NO_MEM;
-    pp->pp_ref++;
+    page_incref(pp);
     if((*pte)&PTE_P){//remove the existing page
         page_remove(pgdir,va);
     }
     *pte=page2pa(pp)|perm|PTE_P;
+    // Remember that this table maps PTE_SHARE pages: fork must not
+    // share it (see pgdir_fork).
+    if(perm&PTE_SHARE) pgdir[PDX(va)]|=PTE_SHARE;
 	return 0;
 }
 
+//
+// Resolve a write fault at va in pgdir that is due to fork: first give
+// pgdir its own copy of a page table still shared since fork (see
+// pgdir_unshare), then a private, writable copy of a copy-on-write page.
+// If nothing else maps the page any more, it is simply made writable.
+// The caller must hold the lock of the env that owns pgdir, and pgdir's
+// own lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va is not mapped, or is read-only for other reasons
+//   -E_NO_MEM, if a copy could not be allocated
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+    pte_t *pte;
+    struct PageInfo *pp, *np;
+    bool unshared = 0;
+    int perm, r;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    if ((pgdir[PDX(va)] & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW)) {
+        if ((r = pgdir_unshare(pgdir, va)) < 0)
+            return r;
+        unshared = 1;
+    }
+    if ((pp = page_lookup(pgdir, va, &pte)) == NULL)
+        return -E_INVAL;
+    if (!(*pte & PTE_COW))
+        return unshared && (*pte & PTE_W) ? 0 : -E_INVAL;
+    perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+    // Only our mapping refers to pp, and no one can add another without
+    // going through pgdir, whose owner is locked.
+    if (pp->pp_ref == 1) {
+        *pte = page2pa(pp) | perm;
+        tlb_invalidate(pgdir, va);
+        return 0;
+    }
+    if ((np = page_alloc(0)) == NULL)
+        return -E_NO_MEM;
+    memcpy(page2kva(np), page2kva(pp), PGSIZE);
+    return page_insert(pgdir, np, va, perm);
+}
+
+//
+// Map the user part of src below UTOP into dst, for fork, in time
+// proportional to the number of page tables rather than pages.
+//
+// Most page tables are simply shared: both PDEs point at the same
+// table, read-only and marked PTE_COW, and the table's pp_ref counts
+// its sharers.  The first write inside the 4MB region, or any kernel
+// change to the table, gives the writer its own copy (pgdir_unshare).
+// The pp_ref of a page mapped through a shared table counts the table
+// once, not each address space.
+//
+// Two kinds of table are copied entry by entry instead: the one holding
+// the calling thread's user and exception stacks, which are written
+// straight away (and the exception stack page at uxstack by the kernel,
+// so it is left out for the caller to handle), and tables that map
+// PTE_SHARE pages, whose pp_refs users rely on (see pageref).  Their PTE_SHARE and read-only pages are
+// mapped as they are; writable and copy-on-write pages become
+// copy-on-write in both.
+//
+// The caller must hold both owners' locks and src's pgdir lock, and
+// must flush src's TLB afterwards (on every CPU using it, see
+// tlb_shootdown), since its writable mappings lose PTE_W.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated (dst may then be
+//              partly filled in)
+//
+int
+pgdir_fork(pde_t *dst, pde_t *src, uintptr_t uxstack)
+{
+    uint32_t pdx, ptx;
+    pte_t *spt, *dpt, pte;
+    struct PageInfo *pt;
+    int r = 0;
+
+    spin_lock(&pt_lock);
+    for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+        if (!(src[pdx] & PTE_P))
+            continue;
+        if (pdx != PDX(uxstack) && !(src[pdx] & PTE_SHARE)) {
+            src[pdx] = (src[pdx] & ~PTE_W) | PTE_COW;
+            dst[pdx] = src[pdx];
+            page_incref(pa2page(PTE_ADDR(src[pdx])));
+            continue;
+        }
+        // Tables like these are never shared in the first place.
+        assert(!(src[pdx] & PTE_COW));
+        if ((pt = page_alloc(ALLOC_ZERO)) == NULL) {
+            r = -E_NO_MEM;
+            break;
+        }
+        page_incref(pt);
+        dst[pdx] = page2pa(pt) | PTE_P | PTE_W | PTE_U | (src[pdx] & PTE_SHARE);
+        spt = KADDR(PTE_ADDR(src[pdx]));
+        dpt = page2kva(pt);
+        for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+            pte = spt[ptx];
+            if (!(pte & PTE_P)
+                || (uintptr_t) PGADDR(pdx, ptx, 0) == uxstack)
+                continue;
+            if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+                pte = (pte & ~PTE_W) | PTE_COW;
+                spt[ptx] = pte;
+            }
+            page_incref(pa2page(PTE_ADDR(pte)));
+            dpt[ptx] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+        }
+    }
+    spin_unlock(&pt_lock);
+    return r;
+}
+
+//
+// If the page table covering va in pgdir is shared since fork (see
+// pgdir_fork), give pgdir a private copy of it.  Its writable pages
+// become copy-on-write for all the sharers.  If pgdir turns out to be
+// the last sharer, the table just becomes writable again.
+// The caller must hold the lock of the env that owns pgdir, and pgdir's
+// own lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    struct PageInfo *old, *pt;
+    pte_t *opt, *npt;
+    uint32_t ptx;
+
+    if ((*pde & (PTE_P|PTE_COW)) != (PTE_P|PTE_COW))
+        return 0;
+
+    spin_lock(&pt_lock);
+    old = pa2page(PTE_ADDR(*pde));
+    if (old->pp_ref == 1) {
+        *pde = (*pde & ~PTE_COW) | PTE_W;
+    } else {
+        if ((pt = page_alloc(0)) == NULL) {
+            spin_unlock(&pt_lock);
+            return -E_NO_MEM;
+        }
+        page_incref(pt);
+        opt = page2kva(old);
+        npt = page2kva(pt);
+        for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+            // The other sharers see the table read-only, so turning
+            // PTE_W into PTE_COW under them needs no TLB flush.
+            if (opt[ptx] & PTE_W)
+                opt[ptx] = (opt[ptx] & ~PTE_W) | PTE_COW;
+            if (opt[ptx] & PTE_P)
+                page_incref(pa2page(PTE_ADDR(opt[ptx])));
+            npt[ptx] = opt[ptx];
+        }
+        page_decref(old);
+        *pde = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+    }
+    spin_unlock(&pt_lock);
+
+    // Every mapping in the 4MB region was cached read-only.
+    if (!curenv || curenv->env_pgdir == pgdir)
+        lcr3(PADDR(pgdir));
+    tlb_shootdown(pgdir);
+    return 0;
+}
+
+//
+// For env_free: if the page table at index pdx of pgdir is still shared
+// since fork, just drop pgdir's reference to it, leaving the pages it
+// maps to the other sharers, and return 1.  Otherwise return 0, and the
+// caller unmaps the table's pages and frees it as usual.
+//
+int
+pgdir_drop_shared(pde_t *pgdir, uint32_t pdx)
+{
+    struct PageInfo *pt;
+    int dropped = 0;
+
+    spin_lock(&pt_lock);
+    if (pgdir[pdx] & PTE_COW) {
+        pt = pa2page(PTE_ADDR(pgdir[pdx]));
+        if (pt->pp_ref > 1) {
+            page_decref(pt);
+            pgdir[pdx] = 0;
+            dropped = 1;
+        } else
+            pgdir[pdx] = (pgdir[pdx] & ~PTE_COW) | PTE_W;
+    }
+    spin_unlock(&pt_lock);
+    return dropped;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -568,7 +1219,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
     if(pte_store){
         *pte_store = pte;
     }
-    return pa2page(PTE_ADDR(*pte));
+    return pa2page(pte_pa(pte,va));
 }
 
 //
@@ -591,23 +1242,300 @@ page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
     pte_t *pte;
+    // Unmapping writes the page table, which must be ours alone.  Out
+    // of memory to copy it, the page just stays mapped.
+    if(pgdir_unshare(pgdir, va)<0) return;
     struct PageInfo * pg = page_lookup(pgdir, va, &pte);
     if(pg==NULL) return;
-    page_decref(pg);
+    bool shared = *pte & PTE_SHARE;
     *pte = 0;
     tlb_invalidate(pgdir,va);
+    tlb_page_decref(pgdir,pg);
+    // Whoever sleeps on the page may be waiting for us to go away.
+    if(shared) futex_unmapped(page2pa(pg));
+}
+
+// Whether pgdir is the address space of more than one thread.
+static bool
+pgdir_shared(pde_t *pgdir)
+{
+	return pa2page(PADDR(pgdir))->pp_ref > 1;
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
 //
+// Other CPUs running threads of pgdir are told to invalidate it too, in
+// one batch with the rest of the current operation (see tlb_flush).
+//
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	if (!pgdir_shared(pgdir))
+		return;
+	// Leave room to hold the page (if any) unmapped from va.
+	if (b->tb_pgdir != pgdir || b->tb_nheld == TLBHOLD) {
+		tlb_flush();
+		b->tb_pgdir = pgdir;
+	}
+	if (b->tb_n < TLBBATCH)
+		b->tb_va[b->tb_n] = (uintptr_t) va;
+	if (b->tb_n <= TLBBATCH)
+		b->tb_n++;
+}
+
+//
+// Make the other CPUs running threads of pgdir drop all the TLB entries
+// they hold for it, now.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+
+	if (!pgdir_shared(pgdir))
+		return;
+	if (b->tb_pgdir != pgdir) {
+		tlb_flush();
+		b->tb_pgdir = pgdir;
+	}
+	b->tb_n = TLBBATCH + 1;
+	tlb_flush();
+}
+
+//
+// Drop a reference to pp, whose mapping in pgdir was just invalidated.
+// If other CPUs may still cache that mapping, wait until they have all
+// dropped it (see tlb_flush), so the page cannot be reused under them.
+//
+void
+tlb_page_decref(pde_t *pgdir, struct PageInfo *pp)
+{
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+
+	// tlb_invalidate made room for us if it batched the mapping.
+	if (b->tb_pgdir != pgdir || b->tb_nheld == TLBHOLD) {
+		page_decref(pp);
+		return;
+	}
+	b->tb_held[b->tb_nheld++] = pp;
+}
+
+// Drop the references held on pages whose shootdowns every CPU has now
+// taken.
+static void
+tlb_release(void)
+{
+	struct PageInfo **ppp, *pp;
+	uint32_t oldest = 0, e;
+	int i;
+
+	if (!tlb_held)
+		return;
+	spin_lock(&tlb_hold_lock);
+	for (i = 0; i < ncpu; i++) {
+		spin_lock(&tlb_mailboxes[i].tm_lock);
+		e = tlb_mailboxes[i].tm_epoch;
+		spin_unlock(&tlb_mailboxes[i].tm_lock);
+		if (e && (!oldest || EPOCH_BEFORE(e, oldest)))
+			oldest = e;
+	}
+	for (ppp = (struct PageInfo **) &tlb_held; (pp = *ppp); ) {
+		if (oldest && !EPOCH_BEFORE(pp->pp_hold_epoch, oldest)) {
+			ppp = &pp->pp_link;
+			continue;
+		}
+		*ppp = pp->pp_link;
+		pp->pp_link = NULL;
+		for (; pp->pp_hold > 0; pp->pp_hold--)
+			page_decref(pp);
+	}
+	spin_unlock(&tlb_hold_lock);
+}
+
+//
+// Send the invalidations this CPU has batched up to the other CPUs
+// running threads of their address space, then release the pages that
+// were waiting for them.  pgdir_unlock calls this, so a batch covers one
+// operation on an address space.
+//
+// Each CPU has a mailbox of invalidations to do, which overflows into a
+// full flush.  A CPU in user mode gets a T_TLBFLUSH IPI and empties the
+// mailbox on its way into the kernel (tlb_enter_kernel), which we wait
+// for.  We can't wait for a CPU in the kernel, since it may be spinning
+// on a lock we hold.  So the batch's pages go on tlb_held instead, until
+// the CPU empties its mailbox: before it next touches user memory
+// through an address space (in user_mem_check, and on taking a pgdir
+// lock), on its way back to user mode (tlb_leave_kernel), or when it
+// halts (sched_halt).  Any later tlb_flush releases them.
+//
+void
+tlb_flush(void)
+{
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+	struct TlbMailbox *m;
+	struct PageInfo *pp;
+	struct CpuInfo *c;
+	uint32_t sent = 0, epoch = 0;
+	bool held = 0;
+	int i;
+
+	if (!b->tb_pgdir) {
+		tlb_release();
+		return;
+	}
+	if (b->tb_n) {
+		while ((epoch = __sync_add_and_fetch(&tlb_epoch, 1)) == 0)
+			;
+		// Order our page table writes before looking at the other CPUs.
+		asm volatile("mfence" ::: "memory");
+		for (c = cpus; c < cpus + ncpu; c++) {
+			if (c == thiscpu || c->cpu_pgdir != b->tb_pgdir)
+				continue;
+			m = &tlb_mailboxes[c->cpu_id];
+			spin_lock(&m->tm_lock);
+			if (b->tb_n > TLBBATCH || m->tm_n + b->tb_n > TLBBATCH)
+				m->tm_n = TLBBATCH + 1;
+			else
+				for (i = 0; i < b->tb_n; i++)
+					m->tm_va[m->tm_n++] = b->tb_va[i];
+			if (!m->tm_epoch || EPOCH_BEFORE(epoch, m->tm_epoch))
+				m->tm_epoch = epoch;
+			xchg(&c->cpu_tlbflush, 1);
+			spin_unlock(&m->tm_lock);
+			if (c->cpu_user) {
+				lapic_ipi_cpu(c->cpu_id, T_TLBFLUSH);
+				sent |= 1 << (c->cpu_id);
+			} else
+				held = 1;
+		}
+		// Let all the IPIs work in parallel before waiting for any.
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (sent & (1 << (c->cpu_id)))
+				while (c->cpu_tlbflush && c->cpu_user)
+					asm volatile("pause");
+	}
+	if (held && b->tb_nheld) {
+		spin_lock(&tlb_hold_lock);
+		for (i = 0; i < b->tb_nheld; i++) {
+			pp = b->tb_held[i];
+			if (pp->pp_hold++ == 0) {
+				pp->pp_link = tlb_held;
+				tlb_held = pp;
+				pp->pp_hold_epoch = epoch;
+			} else if (EPOCH_BEFORE(pp->pp_hold_epoch, epoch))
+				pp->pp_hold_epoch = epoch;
+		}
+		spin_unlock(&tlb_hold_lock);
+	} else
+		for (i = 0; i < b->tb_nheld; i++)
+			page_decref(b->tb_held[i]);
+	b->tb_pgdir = NULL;
+	b->tb_n = 0;
+	b->tb_nheld = 0;
+	tlb_release();
+}
+
+// Do the invalidations other CPUs left in our mailbox.
+void
+tlb_take(void)
+{
+	struct TlbMailbox *m = &tlb_mailboxes[thiscpu->cpu_id];
+	int i;
+
+	if (!thiscpu->cpu_tlbflush)
+		return;
+	spin_lock(&m->tm_lock);
+	if (m->tm_n > TLBBATCH)
+		lcr3(rcr3());
+	else
+		for (i = 0; i < m->tm_n; i++)
+			invlpg((void *) m->tm_va[i]);
+	m->tm_n = 0;
+	m->tm_epoch = 0;
+	xchg(&thiscpu->cpu_tlbflush, 0);
+	spin_unlock(&m->tm_lock);
+}
+
+// Called on every entry to the kernel from user mode, before anything
+// else, to take any TLB invalidations tlb_flush asked for.
+void
+tlb_enter_kernel(void)
+{
+	tlb_take();
+	thiscpu->cpu_user = 0;
+}
+
+// Called last thing before returning to user mode.
+void
+tlb_leave_kernel(void)
+{
+	// Anything left over from an operation that did not go through
+	// pgdir_unlock.
+	tlb_flush();
+	// Once cpu_user is set, tlb_flush waits for us instead of
+	// leaving the invalidations to us, so check for them after.
+	xchg(&thiscpu->cpu_user, 1);
+	tlb_take();
+}
+
+//
+// Lock the address space pgdir against changes from other CPUs.  See
+// pgdir_locks.
+//
+static struct spinlock *
+pgdir_lockp(pde_t *pgdir)
+{
+	return &pgdir_locks[(PADDR(pgdir) >> PGSHIFT) % NPGDIRLOCK];
+}
+
+void
+pgdir_lock(pde_t *pgdir)
+{
+	spin_lock(pgdir_lockp(pgdir));
+	// Drop the stale entries of changes made before we got the lock.
+	tlb_take();
+}
+
+void
+pgdir_unlock(pde_t *pgdir)
+{
+	tlb_flush();
+	spin_unlock(pgdir_lockp(pgdir));
+}
+
+// Lock two address spaces, which may be one and the same, in a
+// consistent order.
+void
+pgdir_lock_pair(pde_t *a, pde_t *b)
+{
+	struct spinlock *la = pgdir_lockp(a), *lb = pgdir_lockp(b), *t;
+
+	if (la > lb) {
+		t = la;
+		la = lb;
+		lb = t;
+	}
+	spin_lock(la);
+	if (lb != la)
+		spin_lock(lb);
+}
+
+void
+pgdir_unlock_pair(pde_t *a, pde_t *b)
+{
+	struct spinlock *la = pgdir_lockp(a), *lb = pgdir_lockp(b);
+
+	tlb_flush();
+	if (lb != la)
+		spin_unlock(lb);
+	spin_unlock(la);
 }
 
 //
@@ -666,6 +1594,10 @@ static uintptr_t user_mem_check_addr;
 // ULIM, and (2) the page table gives it permission.  These are exactly
 // the tests you should implement here.
 //
+// Unmapped pages in anonymous regions (see region_fault) are mapped on
+// the way, as if the environment had touched them.  The caller must not
+// hold the environment's page directory lock.
+//
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
@@ -676,12 +1608,20 @@ int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
+    // The caller is about to touch the range: drop any TLB entries
+    // other CPUs have invalidated since (see tlb_flush).
+    tlb_take();
     uint32_t L=(uint32_t)ROUNDDOWN(va,PGSIZE);
     uint32_t R=(uint32_t)ROUNDUP(va+len,PGSIZE);
     uint32_t needed=(perm|PTE_P);
     for(uint32_t i=L;i<R;i+=PGSIZE){
+        // A page table shared since fork is read-only through its PDE.
         pte_t *pte=pgdir_walk(env->env_pgdir,(void*)i,0);
-        if(pte==NULL||(*pte&needed)!=needed){
+        if((pte==NULL||!(*pte&PTE_P))
+           &&region_fault(env->env_pgdir,i)==0)
+            pte=pgdir_walk(env->env_pgdir,(void*)i,0);
+        if(pte==NULL||(*pte&needed)!=needed
+           ||(env->env_pgdir[PDX(i)]&needed)!=needed){
             uint32_t ret=i;
             if(ret<(uint32_t)va) ret=(uint32_t)va;
             user_mem_check_addr=ret;
@@ -705,10 +1645,67 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		env->env_exit_status = -E_FAULT;
 		env_destroy(env);	// may not return
 	}
 }
 
+//
+// Copy len bytes between env's memory at va and the kernel buffer buf:
+// into buf if out is 0, out of it if out is 1.  The copy goes through
+// the kernel's mapping of each page, with env's page directory locked,
+// so another thread of env unmapping a page meanwhile cannot make the
+// kernel fault.  The caller must not hold env's page directory lock, and
+// should have checked the range with user_mem_check first, which also
+// maps in any pages of anonymous regions.
+//
+// Returns 0 on success, -E_FAULT if some page is not mapped with PTE_U,
+// and with PTE_W when copying out (nothing is then copied out past it).
+//
+static int
+user_mem_copy(struct Env *env, uintptr_t va, char *buf, size_t len, bool out)
+{
+	int perm = PTE_P | PTE_U | (out ? PTE_W : 0);
+	size_t n;
+	pte_t *pte;
+	void *kva;
+	int r = 0;
+
+	if (va >= ULIM || len > ULIM - va)
+		return -E_FAULT;
+	pgdir_lock(env->env_pgdir);
+	for (; len > 0; va += n, buf += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(va));
+		pte = pgdir_walk(env->env_pgdir, (void *) va, 0);
+		if (!pte || (*pte & perm) != perm
+		    || (env->env_pgdir[PDX(va)] & perm) != perm) {
+			r = -E_FAULT;
+			break;
+		}
+		kva = KADDR(pte_pa(pte, (void *) va) + PGOFF(va));
+		if (out)
+			memcpy(kva, buf, n);
+		else
+			memcpy(buf, kva, n);
+	}
+	pgdir_unlock(env->env_pgdir);
+	return r;
+}
+
+// Copy len bytes from env's memory at va into dst; see user_mem_copy.
+int
+user_mem_copyin(struct Env *env, void *dst, const void *va, size_t len)
+{
+	return user_mem_copy(env, (uintptr_t) va, dst, len, 0);
+}
+
+// Copy len bytes from src to env's memory at va; see user_mem_copy.
+int
+user_mem_copyout(struct Env *env, void *va, const void *src, size_t len)
+{
+	return user_mem_copy(env, (uintptr_t) va, (char *) src, len, 1);
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
@@ -931,6 +1928,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return pte_pa(pgdir, (void *) va);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1156,3 +2155,25 @@ check_page_installed_pgdir(void)
 
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
+
+// Check page_alloc_order and page_free_order, once the buddy allocator
+// is on.
+static void
+check_buddy(void)
+{
+	uint32_t before[MAXORDER + 1];
+	struct PageInfo *pp0, *pp1;
+
+	memcpy(before, page_free_blocks, sizeof(before));
+	assert(!page_alloc_order(MAXORDER + 1, 0));
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp1 = page_alloc_order(3, 0)));
+	assert(pp0 != pp1);
+	assert((pp0 - pages) % 8 == 0 && (pp1 - pages) % 8 == 0);
+	assert(((uint32_t *) page2kva(pp0))[8 * PGSIZE / 4 - 1] == 0);
+	page_free_order(pp1, 3);
+	page_free_order(pp0, 3);
+	assert(memcmp(before, page_free_blocks, sizeof(before)) == 0);
+
+	cprintf("check_buddy() succeeded!\n");
+}
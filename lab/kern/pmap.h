@@ -51,22 +51,67 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_order hands out: 2^MAXORDER pages (4MB).
+#define MAXORDER	10
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+bool	page_prezero(void);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_buddy_print(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	pgdir_fork(pde_t *dst, pde_t *src, uintptr_t uxstack);
+int	pgdir_unshare(pde_t *pgdir, const void *va);
+int	pgdir_drop_shared(pde_t *pgdir, uint32_t pdx);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_page_decref(pde_t *pgdir, struct PageInfo *pp);
+void	tlb_flush(void);
+void	tlb_take(void);
+void	tlb_enter_kernel(void);
+void	tlb_leave_kernel(void);
+
+void	pgdir_lock(pde_t *pgdir);
+void	pgdir_unlock(pde_t *pgdir);
+void	pgdir_lock_pair(pde_t *a, pde_t *b);
+void	pgdir_unlock_pair(pde_t *a, pde_t *b);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_copyin(struct Env *env, void *dst, const void *va, size_t len);
+int	user_mem_copyout(struct Env *env, void *va, const void *src, size_t len);
+
+// Whether the user may write through the PTE *pte for va in pgdir.  A
+// page table still shared since fork keeps its PTEs' PTE_W bits but is
+// mapped read-only through its PDE (see pgdir_fork).
+static inline bool
+pte_writable(pde_t *pgdir, void *va, pte_t *pte)
+{
+	return (*pte & PTE_W) && (pgdir[PDX(va)] & PTE_W);
+}
+
+// The physical address of the page that pte, as returned by pgdir_walk
+// for va, maps va to.  pte may be a 4MB-page PDE.
+static inline physaddr_t
+pte_pa(pte_t *pte, const void *va)
+{
+	if (*pte & PTE_PS)
+		return PTE_ADDR(*pte) + ((uintptr_t) va & (PTSIZE - 1) & ~(PGSIZE - 1));
+	return PTE_ADDR(*pte);
+}
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -0,0 +1,194 @@
+// Anonymous regions: stretches of an address space whose pages are
+// allocated, zeroed, the first time they are touched (see
+// sys_region_reserve), by the kernel itself rather than a user-level
+// page fault handler.
+//
+// A region belongs to a page directory, so the threads sharing one see
+// the same regions.  Regions hang off buckets hashed by page directory,
+// and last as long as the address space does.
+
+#include <inc/error.h>
+#include <inc/mmu.h>
+
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+#include <kern/region.h>
+
+#define NREGIONBUCKET	16
+
+struct Region {
+	pde_t *rg_pgdir;		// The address space it belongs to
+	uintptr_t rg_start;		// Covers [rg_start, rg_end)
+	uintptr_t rg_end;
+	int rg_perm;			// For the pages faulted in
+	struct Region *rg_next;		// Next in the bucket
+};
+
+struct RegionBucket {
+	struct spinlock rb_lock;
+	struct Region *rb_regions;
+};
+
+static struct RegionBucket region_buckets[NREGIONBUCKET] = {
+#ifdef DEBUG_SPINLOCK
+	[0 ... NREGIONBUCKET - 1] = { .rb_lock = { .name = "region_lock" } }
+#endif
+};
+
+static struct RegionBucket *
+region_bucket(pde_t *pgdir)
+{
+	return &region_buckets[(PADDR(pgdir) >> PGSHIFT) % NREGIONBUCKET];
+}
+
+// Find pgdir's region containing va, or failing that the lowest one
+// above va.  The bucket must be locked.
+static struct Region *
+region_find(struct RegionBucket *b, pde_t *pgdir, uintptr_t va)
+{
+	struct Region *rg, *best = NULL;
+
+	for (rg = b->rb_regions; rg; rg = rg->rg_next)
+		if (rg->rg_pgdir == pgdir && rg->rg_end > va
+		    && (!best || rg->rg_start < best->rg_start))
+			best = rg;
+	return best;
+}
+
+//
+// Record [va, va+len) as an anonymous region of pgdir, whose pages get
+// mapped with permissions perm when first touched.  va and len must be
+// page-aligned, and the range must lie below UTOP; the caller checks.
+// Pages already mapped in the range are left alone.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the range overlaps one of pgdir's regions
+//   -E_NO_MEM, if the region could not be recorded
+//
+int
+region_reserve(pde_t *pgdir, uintptr_t va, size_t len, int perm)
+{
+	struct RegionBucket *b = region_bucket(pgdir);
+	struct Region *rg, *next;
+
+	if ((rg = kmalloc(sizeof(struct Region), 0)) == NULL)
+		return -E_NO_MEM;
+	rg->rg_pgdir = pgdir;
+	rg->rg_start = va;
+	rg->rg_end = va + len;
+	rg->rg_perm = perm;
+
+	spin_lock(&b->rb_lock);
+	if ((next = region_find(b, pgdir, va)) && next->rg_start < va + len) {
+		spin_unlock(&b->rb_lock);
+		kfree(rg);
+		return -E_INVAL;
+	}
+	rg->rg_next = b->rb_regions;
+	b->rb_regions = rg;
+	spin_unlock(&b->rb_lock);
+	return 0;
+}
+
+// Return the permissions of the pages of pgdir's region containing va,
+// or 0 if va lies in no region.
+int
+region_lookup(pde_t *pgdir, uintptr_t va)
+{
+	struct RegionBucket *b = region_bucket(pgdir);
+	struct Region *rg;
+	int perm = 0;
+
+	spin_lock(&b->rb_lock);
+	if ((rg = region_find(b, pgdir, va)) && rg->rg_start <= va)
+		perm = rg->rg_perm;
+	spin_unlock(&b->rb_lock);
+	return perm;
+}
+
+//
+// Handle a fault on the unmapped page at va in pgdir, if it lies in a
+// region, by mapping a fresh zeroed page there.  The caller must not
+// hold pgdir's lock.  The page may have been mapped meanwhile by another
+// thread; that counts as success too.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if va lies in no region
+//   -E_NO_MEM, if there is no memory for the page or its page table
+//
+int
+region_fault(pde_t *pgdir, uintptr_t va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r = 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (va >= UTOP || !(perm = region_lookup(pgdir, va)))
+		return -E_FAULT;
+	// Allocate (and zero) the page before locking the address space.
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+	pgdir_lock(pgdir);
+	if ((pte = pgdir_walk(pgdir, (void *) va, 0)) && (*pte & PTE_P))
+		page_free(pp);
+	else if ((r = page_insert(pgdir, pp, (void *) va, perm)) < 0)
+		page_free(pp);
+	pgdir_unlock(pgdir);
+	return r;
+}
+
+//
+// Replace the regions of dst, a new address space forked from src, with
+// copies of src's.  The pages dst faults in are its own.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a region could not be recorded (dst may then have
+//              some of them)
+//
+int
+region_fork(pde_t *dst, pde_t *src)
+{
+	struct RegionBucket *b = region_bucket(src);
+	struct Region *rg;
+	uintptr_t va = 0;
+	int r;
+
+	region_free(dst);
+	// Copy one region at a time in address order, so as not to
+	// allocate with the bucket locked.
+	for (;;) {
+		spin_lock(&b->rb_lock);
+		rg = region_find(b, src, va);
+		spin_unlock(&b->rb_lock);
+		if (!rg)
+			return 0;
+		// Regions last as long as src, which the caller keeps alive.
+		if ((r = region_reserve(dst, rg->rg_start,
+					rg->rg_end - rg->rg_start,
+					rg->rg_perm)) < 0)
+			return r;
+		va = rg->rg_end;
+	}
+}
+
+// Forget all of pgdir's regions, as the address space goes away.
+void
+region_free(pde_t *pgdir)
+{
+	struct RegionBucket *b = region_bucket(pgdir);
+	struct Region **rgp, *rg;
+
+	spin_lock(&b->rb_lock);
+	for (rgp = &b->rb_regions; (rg = *rgp); )
+		if (rg->rg_pgdir == pgdir) {
+			*rgp = rg->rg_next;
+			kfree(rg);
+		} else
+			rgp = &rg->rg_next;
+	spin_unlock(&b->rb_lock);
+}
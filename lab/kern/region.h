@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_REGION_H
+#define JOS_KERN_REGION_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+int	region_reserve(pde_t *pgdir, uintptr_t va, size_t len, int perm);
+int	region_lookup(pde_t *pgdir, uintptr_t va);
+int	region_fault(pde_t *pgdir, uintptr_t va);
+int	region_fork(pde_t *dst, pde_t *src);
+void	region_free(pde_t *pgdir);
+
+#endif	// !JOS_KERN_REGION_H
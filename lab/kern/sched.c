@@ -4,8 +4,99 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+
+// Protects every env's env_status and env_cpunum, and the choice of the
+// next env to run.
+struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sched_lock"
+#endif
+};
+
+// Bit i is set while cpus[i] is halted in sched_halt.
+static volatile uint32_t sched_idle_mask;
+
+// Send a reschedule IPI to one halted CPU, if there is one.
+// The CPU's idle bit is cleared here so that a burst of wakeups
+// spreads over several idle CPUs instead of kicking the same one.
+void
+sched_kick(void)
+{
+	uint32_t idle;
+	int i;
+
+	idle = sched_idle_mask & ~(1 << thiscpu->cpu_id);
+	while (idle) {
+		i = __builtin_ctz(idle);
+		if (test_and_clear_bit(&sched_idle_mask, i)) {
+			lapic_ipi_cpu(cpus[i].cpu_id, T_RESCHED);
+			return;
+		}
+		idle &= ~(1 << i);
+	}
+}
+
+// Make e runnable, and kick a halted CPU (if any) so that e does not
+// have to wait for the next timer interrupt to be picked up.
+// e must be locked by the caller.  Only a stopped env is woken up; if
+// e has not yet left the CPU it stopped on, it simply keeps running
+// there, so that it never runs on two CPUs at once.
+void
+sched_wakeup(struct Env *e)
+{
+	bool kick = 0;
+
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		if (e->env_cpunum >= 0)
+			e->env_status = ENV_RUNNING;
+		else {
+			e->env_status = ENV_RUNNABLE;
+			kick = 1;
+		}
+	}
+	spin_unlock(&sched_lock);
+	if (kick)
+		sched_kick();
+}
+
+// Stop e from being scheduled.  e must be locked by the caller.  If e is
+// running, it carries on until it next enters the kernel; in particular
+// curenv, blocking itself, must then call sched_yield.
+void
+sched_suspend(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_RUNNING)
+		e->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(&sched_lock);
+}
+
+// This CPU is switching away from e (if it was holding e at all): a
+// running e becomes runnable again.  Returns e if it is a zombie that
+// this CPU must now free, once sched_lock has been released.
+// Called with sched_lock held.
+struct Env *
+sched_release(struct Env *e)
+{
+	if (!e || e->env_cpunum != thiscpu->cpu_id)
+		return NULL;
+	e->env_cpunum = -1;
+	if (e->env_status == ENV_RUNNING)
+		e->env_status = ENV_RUNNABLE;
+	return e->env_status == ENV_DYING ? e : NULL;
+}
+
+// Called on the way out of sched_halt's hlt loop.
+void
+sched_unidle(void)
+{
+	test_and_clear_bit(&sched_idle_mask, thiscpu->cpu_id);
+}
 
 // Choose a user environment to run and run it.
 void
@@ -30,6 +121,7 @@ sched_yield(void)
 	// below to halt the cpu.
 
 	// LAB 4: Your code here.
+    spin_lock(&sched_lock);
     idle = thiscpu->cpu_env;
     uint32_t start;
     if(idle==NULL) start=0;
@@ -48,16 +140,21 @@ sched_yield(void)
         i%=NENV;
     }while(i!=start);
 
-    if(idle&&idle->env_status==ENV_RUNNING){
+    if(idle&&idle->env_status==ENV_RUNNING&&idle->env_cpunum==thiscpu->cpu_id){
         if(run_env==NULL || idle->priority < run_env->priority){
-            env_run(idle);
-            return;
+            run_env=idle;
         }
     }
 
     if(run_env){
+        // Claim it before dropping the lock so no other CPU takes it.
+        run_env->env_status=ENV_RUNNING;
+        run_env->env_cpunum=thiscpu->cpu_id;
+        spin_unlock(&sched_lock);
         env_run(run_env);
     }
+    // sched_halt takes the lock again itself, and may enter the monitor.
+    spin_unlock(&sched_lock);
 
 	// sched_halt never returns
 	sched_halt();
@@ -69,14 +166,15 @@ sched_yield(void)
 void
 sched_halt(void)
 {
+	struct Env *zombie;
 	int i;
 
-	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
+	// For debugging and testing purposes, if there are no
+	// environments left in the system, then drop into the kernel
+	// monitor.  Envs that are alive but blocked (on the console, IPC,
+	// a futex...) wait for an interrupt to wake them, so just halt.
 	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		if (envs[i].env_status != ENV_FREE)
 			break;
 	}
 	if (i == NENV) {
@@ -85,17 +183,34 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
+	// Send any TLB shootdown still batched up, and release the pages
+	// that waited for them.
+	tlb_flush();
+
+	// Mark that no environment is running on this CPU.  Envs that
+	// become runnable from now on will kick us out of hlt.
+	spin_lock(&sched_lock);
+	zombie = sched_release(curenv);
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
+	thiscpu->cpu_pgdir = NULL;
+	// The lcr3 dropped every user TLB entry; let tlb_flush know, so
+	// the pages it holds for us need not wait until we wake.
+	tlb_take();
 
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, we know we were idle
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	test_and_set_bit(&sched_idle_mask, thiscpu->cpu_id);
+	spin_unlock(&sched_lock);
+
+	if (zombie)
+		env_free(zombie);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Zero free pages for page_alloc(ALLOC_ZERO) until the pool is full
+	// or a wakeup kicks us (the reschedule IPI waits for the sti below).
+	while ((sched_idle_mask & (1 << thiscpu->cpu_id)) && page_prezero())
+		;
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -109,5 +224,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt loop returned");
 }
 
@@ -6,7 +6,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <kern/spinlock.h>
+
+struct Env;
+
+extern struct spinlock sched_lock;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_wakeup(struct Env *e);
+void sched_suspend(struct Env *e);
+struct Env *sched_release(struct Env *e);
+void sched_kick(void);
+void sched_unidle(void);
+
 #endif	// !JOS_KERN_SCHED_H
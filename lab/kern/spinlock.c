@@ -9,13 +9,6 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,18 +32,68 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
+}
+#endif
+
+#ifdef SPINLOCK_STATS
+// Contention statistics, one entry per lock name (all env locks, say,
+// share one).  Counters are kept per CPU so that updating them needs no
+// lock and does not bounce cache lines; lockstat_print sums them.
+#define NLOCKSTAT	32
+
+struct LockStatCpu {
+	uint64_t acquires;	// Times the lock was taken
+	uint64_t contended;	// ... of which it had to be waited for
+	uint64_t spin_cycles;	// TSC cycles spent waiting for it
+	uint64_t max_hold;	// Longest time it was held, in TSC cycles
+} __attribute__((aligned(CACHELINE)));
+
+struct LockStat {
+	const char *name;
+	struct LockStatCpu cpu[NCPU];
+};
+
+static struct LockStat lockstats[NLOCKSTAT];
+static volatile uint32_t nlockstats;
+static volatile uint32_t lockstats_busy;	// Guards adding an entry
+
+// Find (or add) the statistics entry for lk's name.  Locks initialized
+// statically rather than with __spin_initlock come here on first use.
+static struct LockStat *
+lockstat_lookup(struct spinlock *lk)
+{
+	const char *name = lk->name ? lk->name : "?";
+	struct LockStat *ls;
+	uint32_t i;
+
+	// A raw test-and-set lock: a spinlock here would recurse.
+	while (xchg(&lockstats_busy, 1) != 0)
+		asm volatile ("pause");
+	for (i = 0; i < nlockstats; i++)
+		if (strcmp(lockstats[i].name, name) == 0)
+			break;
+	if (i == nlockstats && i < NLOCKSTAT) {
+		lockstats[i].name = name;
+		nlockstats = i + 1;
+	}
+	ls = i < NLOCKSTAT ? &lockstats[i] : NULL;
+	xchg(&lockstats_busy, 0);
+	return ls;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
+	lk->next = lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
 #endif
+#ifdef SPINLOCK_STATS
+	lk->stat = lockstat_lookup(lk);
+#endif
 }
 
 // Acquire the lock.
@@ -60,16 +103,41 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+#ifdef SPINLOCK_STATS
+	struct LockStatCpu *st;
+	uint64_t spin_start;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
-		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+		panic("CPU %d cannot acquire %s: already holding", thiscpu->cpu_id, lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// reordered before it.  Then wait for our turn.
+	ticket = xadd(&lk->next, 1);
+#ifdef SPINLOCK_STATS
+	if (!lk->stat)
+		lk->stat = lockstat_lookup(lk);
+	st = lk->stat ? &lk->stat->cpu[thiscpu->cpu_id] : NULL;
+	if (lk->owner != ticket) {
+		spin_start = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+		if (st) {
+			st->contended++;
+			st->spin_cycles += read_tsc() - spin_start;
+		}
+	}
+	if (st)
+		st->acquires++;
+	lk->acquired_at = read_tsc();
+#else
+	while (lk->owner != ticket)
 		asm volatile ("pause");
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -106,11 +174,66 @@ spin_unlock(struct spinlock *lk)
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
+#ifdef SPINLOCK_STATS
+	if (lk->stat) {
+		struct LockStatCpu *st = &lk->stat->cpu[thiscpu->cpu_id];
+		uint64_t held = read_tsc() - lk->acquired_at;
+		if (held > st->max_hold)
+			st->max_hold = held;
+	}
+#endif
+
+	// Only the holder writes 'owner', so a plain store hands the lock
+	// to the next ticket.  x86 does not reorder stores with earlier
+	// loads or stores (vol 3, 8.2.2), and the empty asm keeps gcc from
+	// moving the critical section's accesses past the release.
+	asm volatile("" : : : "memory");
+	lk->owner = lk->owner + 1;
+}
+
+#ifdef SPINLOCK_STATS
+// Print the statistics of every lock name that has been used.
+void
+lockstat_print(void)
+{
+	uint64_t acq, cont, spin, hold;
+	uint32_t i, c;
+
+	cprintf("%-16s %10s %10s %14s %12s\n", "lock", "acquires",
+		"contended", "spin cycles", "max hold");
+	for (i = 0; i < nlockstats; i++) {
+		acq = cont = spin = hold = 0;
+		for (c = 0; c < NCPU; c++) {
+			struct LockStatCpu *st = &lockstats[i].cpu[c];
+			acq += st->acquires;
+			cont += st->contended;
+			spin += st->spin_cycles;
+			if (st->max_hold > hold)
+				hold = st->max_hold;
+		}
+		cprintf("%-16s %10llu %10llu %14llu %12llu\n", lockstats[i].name,
+			acq, cont, spin, hold);
+	}
+}
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+// Zero all counters, e.g. to measure one workload.
+void
+lockstat_reset(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nlockstats; i++)
+		memset(lockstats[i].cpu, 0, sizeof(lockstats[i].cpu));
+}
+#else
+void
+lockstat_print(void)
+{
+	cprintf("lock statistics are disabled (see SPINLOCK_STATS)\n");
 }
+
+void
+lockstat_reset(void)
+{
+}
+#endif
@@ -6,9 +6,21 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+#ifdef DEBUG_SPINLOCK
+// Comment this to disable lock contention statistics (kept per lock
+// name, see the lockstat monitor command).
+#define SPINLOCK_STATS
+#endif
+
+struct LockStat;
+
 // Mutual exclusion lock.
+// A ticket lock: CPUs take a ticket from 'next' and are served in
+// order as 'owner' advances, so waiters are FIFO and spin reading a
+// shared line instead of hammering it with locked writes.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;  // Next ticket to hand out
+	volatile uint32_t owner; // Ticket now being served
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -17,6 +29,10 @@ struct spinlock {
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
+#ifdef SPINLOCK_STATS
+	struct LockStat *stat; // Statistics for this lock's name
+	uint64_t acquired_at;  // TSC when the holder acquired it
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
@@ -25,24 +41,7 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+void lockstat_print(void);
+void lockstat_reset(void);
 
 #endif
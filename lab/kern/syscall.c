@@ -12,6 +12,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/futex.h>
+#include <kern/region.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -23,18 +25,31 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
+    char buf[128];
+    size_t n;
+
     user_mem_assert(curenv, (void*)s, len, PTE_U);
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user.  Copy it out a piece at a
+	// time first: another thread may unmap it as we go.
+    for (; len > 0; s += n, len -= n) {
+        n = MIN(len, sizeof(buf));
+        if (user_mem_copyin(curenv, buf, s, n) < 0) {
+            curenv->env_exit_status = -E_FAULT;
+            env_destroy(curenv);
+            return;
+        }
+        cprintf("%.*s", n, buf);
+    }
 }
 
 // Read a character from the system console without blocking.
-// Returns the character, or 0 if there is no input waiting.
+// Returns the character, or 0 if there is no input waiting; the caller
+// is then sent NOTIFY_CONS when some arrives (see sys_notify_wait).
 static int
 sys_cgetc(void)
 {
-	return cons_getc();
+	return cons_getc_notify(curenv->env_id);
 }
 
 // Returns the current environment's envid.
@@ -55,12 +70,38 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
+	env_destroy_locked(e);
 	return 0;
 }
 
+// Block until environment envid has been freed.
+// Any environment may wait for any other.
+//
+// Returns 0 after envid is gone; its exit status (0, or -E_FAULT if the
+// kernel killed it for a fault) is then in our env_wait_status field.
+// Returns < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist (it may
+//		already have exited).
+//	-E_INVAL if envid is the current environment.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e;
+
+	env_wait_cancel(curenv);
+	if (envid2env_lock_curenv(envid, &e) < 0)
+		return -E_BAD_ENV;
+	if (e == curenv) {
+		env_unlock(e);
+		return -E_INVAL;
+	}
+	env_wait(e);
+	env_unlock_pair(curenv, e);
+	sched_yield();
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -91,10 +132,119 @@ sys_exofork(void)
     return e->env_id;
 }
 
+// Fork curenv in one go: the child gets a copy-on-write copy of
+// curenv's address space below UTOP (see pgdir_fork) and of its
+// regions, a fresh exception stack if curenv has one, the same page
+// fault upcall, and curenv's registers, tweaked so sys_fork appears to
+// return 0 in it.
+// Copy-on-write faults are then resolved by page_fault_handler.
+// Unlike sys_exofork, the child is left runnable.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    struct Env *e;
+    struct PageInfo *pp;
+    void *uxstack;
+    envid_t envid;
+    int r;
+
+    if ((r = env_alloc(&e, curenv->env_id)) < 0)
+        return r;
+    envid = e->env_id;
+    env_lock_pair(curenv, e);
+    e->env_tf = curenv->env_tf;
+    e->env_tf.tf_regs.reg_eax = 0;
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    // The child is a copy of the calling thread only.
+    e->env_uxstacktop = curenv->env_uxstacktop;
+    uxstack = (void *) (e->env_uxstacktop - PGSIZE);
+
+    pgdir_lock(curenv->env_pgdir);
+    r = pgdir_fork(e->env_pgdir, curenv->env_pgdir, (uintptr_t) uxstack);
+    if (r == 0)
+        r = region_fork(e->env_pgdir, curenv->env_pgdir);
+    if (r == 0 && page_lookup(curenv->env_pgdir, uxstack, NULL)) {
+        if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+            r = -E_NO_MEM;
+        else if ((r = page_insert(e->env_pgdir, pp, uxstack,
+                                  PTE_P|PTE_U|PTE_W)) < 0)
+            page_free(pp);
+    }
+    // Our writable pages may just have become copy-on-write.
+    lcr3(PADDR(curenv->env_pgdir));
+    tlb_shootdown(curenv->env_pgdir);
+    pgdir_unlock(curenv->env_pgdir);
+    if (r == 0)
+        sched_wakeup(e);
+    env_unlock_pair(curenv, e);
+
+    if (r < 0) {
+        env_destroy(e);
+        return r;
+    }
+    return envid;
+}
+
+// Create a thread of the current environment: a new environment that
+// shares our address space (page directory) but runs on its own, from
+// 'eip' with its stack pointer at 'esp'.  Its page fault upcall, if we
+// have one, runs on the exception stack page just below 'uxstacktop',
+// which the caller provides like the stack itself.  The thread gets our
+// priority and starts out runnable.
+//
+// Returns the envid of the new thread, or < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or uxstacktop lies above UTOP, or uxstacktop
+//		is not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t uxstacktop)
+{
+    struct Env *e;
+    envid_t envid;
+    int r;
+
+    if (eip >= UTOP || esp > UTOP || uxstacktop > UTOP
+        || uxstacktop < PGSIZE || PGOFF(uxstacktop))
+        return -E_INVAL;
+    if ((r = env_alloc(&e, curenv->env_id)) < 0)
+        return r;
+    envid = e->env_id;
+    env_lock_pair(curenv, e);
+    // Trade the fresh page directory for ours; env_free tears down only
+    // the last reference.
+    region_free(e->env_pgdir);
+    page_decref(pa2page(PADDR(e->env_pgdir)));
+    pgdir_lock(curenv->env_pgdir);
+    page_incref(pa2page(PADDR(curenv->env_pgdir)));
+    pgdir_unlock(curenv->env_pgdir);
+    e->env_pgdir = curenv->env_pgdir;
+
+    e->env_tf = curenv->env_tf;
+    e->env_tf.tf_eip = eip;
+    e->env_tf.tf_esp = esp;
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    e->env_uxstacktop = uxstacktop;
+    e->env_base_priority = curenv->env_base_priority;
+    env_inherit_priority(e);
+    sched_wakeup(e);
+    env_unlock_pair(curenv, e);
+    return envid;
+}
+
+// Set envid's base priority (lower values run first).  The env may
+// still run at a better priority while it serves an IPC call from, or
+// has sends queued by, a more important env; see env_inherit_priority.
 static int sys_env_set_priority(envid_t envid, int priority){
     struct Env *e;
-    if(envid2env(envid,&e,1)<0) return -E_BAD_ENV;
-    e->priority=priority;
+    if(envid2env_lock(envid,&e,1)<0) return -E_BAD_ENV;
+    e->env_base_priority=priority;
+    env_inherit_priority(e);
+    env_unlock(e);
     return 0;
 }
 
@@ -105,6 +255,10 @@ static int sys_env_set_priority(envid_t envid, int priority){
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if status is ENV_RUNNABLE and envid is blocked in
+//		sys_ipc_send, sys_futex_wait, sys_notify_wait or
+//		sys_env_wait: it must be woken by whatever it waits for,
+//		which takes it off the wait queue and sets its return value.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -117,8 +271,15 @@ sys_env_set_status(envid_t envid, int status)
 	// LAB 4: Your code here.
     if(status!=ENV_RUNNABLE&&status!=ENV_NOT_RUNNABLE) return -E_INVAL;
     struct Env *e;
-    if(envid2env(envid,&e,1)<0) return -E_BAD_ENV;
-    e->env_status=status;
+    if(envid2env_lock(envid,&e,1)<0) return -E_BAD_ENV;
+    if(status==ENV_RUNNABLE&&(e->env_ipc_sendto||e->env_futex_key
+                              ||e->env_notify_mask||e->env_wait_for)){
+        env_unlock(e);
+        return -E_INVAL;
+    }
+    if(status==ENV_RUNNABLE) sched_wakeup(e);
+    else sched_suspend(e);
+    env_unlock(e);
     return 0;
 }
 
@@ -129,6 +290,7 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf was unmapped (by another thread) as it was read.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -136,13 +298,18 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// Remember to check whether the user has supplied us with a good
 	// address!
     struct Env *e;
+    struct Trapframe ntf;
     int r;
-    if((r=envid2env(envid,&e,1))<0) return r;
-    user_mem_assert(e,tf,sizeof(struct Trapframe),PTE_U);
-    e->env_tf = *tf;
+    // tf is in our own address space; copy it before locking anything,
+    // since a bad pointer destroys us.
+    user_mem_assert(curenv,tf,sizeof(struct Trapframe),PTE_U);
+    if((r=user_mem_copyin(curenv,&ntf,tf,sizeof(ntf)))<0) return r;
+    if((r=envid2env_lock(envid,&e,1))<0) return r;
+    e->env_tf = ntf;
     e->env_tf.tf_eflags |= FL_IF;
     e->env_tf.tf_eflags &= ~(FL_IOPL_MASK);
     e->env_tf.tf_cs |=3;
+    env_unlock(e);
     return 0;
 }
 
@@ -159,8 +326,9 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
     struct Env *e;
-    if(envid2env(envid,&e,1)<0) return -E_BAD_ENV;
+    if(envid2env_lock(envid,&e,1)<0) return -E_BAD_ENV;
     e->env_pgfault_upcall = func;
+    env_unlock(e);
     return 0;
 }
 
@@ -192,9 +360,6 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
 	// LAB 4: Your code here.
 
-    // Error #1: -E_BAD_ENV
-    struct Env *e;
-    if(envid2env(envid,&e,1)<0) return -E_BAD_ENV;
     // Error #2: -E_INVAL(va>=UTOP or va not aligned)
     if((uint32_t)va>=UTOP||PGOFF(va)) return -E_INVAL;
     // Error #3: -E_INVAL(perm wrong)
@@ -202,13 +367,25 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     if((~perm)&set_mask) return -E_INVAL;
     if(perm&(~PTE_SYSCALL)) return -E_INVAL;
     // Error #4: -E_NO_MEM
+    // Allocate (and zero) the page before locking the env.
     struct PageInfo *newpg = page_alloc(ALLOC_ZERO);
     if(!newpg) return -E_NO_MEM;
+    // Error #1: -E_BAD_ENV
+    struct Env *e;
+    if(envid2env_lock(envid,&e,1)<0){
+        page_free(newpg);
+        return -E_BAD_ENV;
+    }
 
+    pgdir_lock(e->env_pgdir);
     if(page_insert(e->env_pgdir, newpg, va, perm) < 0){
+        pgdir_unlock(e->env_pgdir);
+        env_unlock(e);
         page_free(newpg);
         return -E_NO_MEM;
     }
+    pgdir_unlock(e->env_pgdir);
+    env_unlock(e);
 
     return 0;
 }
@@ -244,23 +421,35 @@ sys_page_map(envid_t srcenvid, void *srcva,
     
     // Error #1: -E_BAD_ENV
     struct Env *src_env, *dst_env;
+    int r;
     if(envid2env(srcenvid, &src_env, 1)<0) return -E_BAD_ENV;
     if(envid2env(dstenvid, &dst_env, 1)<0) return -E_BAD_ENV;
     //Error #2: -E_INVAL(>=UTOP or not aligned)
     if((uint32_t)srcva>=UTOP||PGOFF(srcva)) return -E_INVAL;
     if((uint32_t)dstva>=UTOP||PGOFF(dstva)) return -E_INVAL;
-    //Error #3: -E_INVAL(srcva not mapped)
-    pte_t *pte;
-    struct PageInfo *src_pg = page_lookup(src_env->env_pgdir, srcva, &pte);
-    if(!src_pg) return -E_INVAL;
     //Error #4: -E_INVAL(perm inappriopriate)
     int set_mask = (PTE_U|PTE_P);
     if((~perm)&set_mask) return -E_INVAL;
     if(perm&(~PTE_SYSCALL)) return -E_INVAL;
+
+    env_lock_pair(src_env, dst_env);
+    if(!env_alive(src_env, srcenvid) || !env_alive(dst_env, dstenvid)){
+        r = -E_BAD_ENV;
+        goto out;
+    }
+    pgdir_lock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+    //Error #3: -E_INVAL(srcva not mapped)
+    pte_t *pte;
+    struct PageInfo *src_pg = page_lookup(src_env->env_pgdir, srcva, &pte);
+    r = -E_INVAL;
     //Error #5: -E_INVAL(read only)
-    if((*pte&&PTE_W)==0 && (perm&PTE_W)) return -E_INVAL;
-    //Error #6: cannot allocate page table
-    return page_insert(dst_env->env_pgdir, src_pg, dstva, perm);
+    if(src_pg && (pte_writable(src_env->env_pgdir, srcva, pte) || !(perm&PTE_W)))
+        //Error #6: cannot allocate page table
+        r = page_insert(dst_env->env_pgdir, src_pg, dstva, perm);
+    pgdir_unlock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+out:
+    env_unlock_pair(src_env, dst_env);
+    return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -270,21 +459,117 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table mapping va, shared since fork, could
+//		not be copied.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
 	// Hint: This function is a wrapper around page_remove().
 
 	// LAB 4: Your code here.
-    // Error #1: -E_BAD_ENV
-    struct Env *e;
-    if(envid2env(envid,&e,1)<0) return -E_BAD_ENV;
     // Error #2: -E_INVAL
     if((uint32_t)va>=UTOP||PGOFF(va)) return -E_INVAL;
-    page_remove(e->env_pgdir,va);
+    // Error #1: -E_BAD_ENV
+    struct Env *e;
+    if(envid2env_lock(envid,&e,1)<0) return -E_BAD_ENV;
+    // Error #3: -E_NO_MEM copying a page table shared since fork
+    pgdir_lock(e->env_pgdir);
+    int r = pgdir_unshare(e->env_pgdir,va);
+    if(r==0) page_remove(e->env_pgdir,va);
+    pgdir_unlock(e->env_pgdir);
+    env_unlock(e);
+    return r;
+}
+
+// The helpers below expect both envs involved to be locked
+// (see envid2env_lock_curenv).
+
+// Check that 'srcenv' may send the page mapped at 'srcva' with 'perm'.
+// On success, stores the page in *pg_store (NULL if srcva >= UTOP, i.e.
+// no page is being sent) and its PTE in *pte_store.
+//
+// Returns 0 on success, -E_INVAL if srcva or perm is inappropriate
+// (see sys_ipc_try_send).
+static int
+ipc_check_page(struct Env *srcenv, void *srcva, unsigned perm,
+	       struct PageInfo **pg_store)
+{
+    pte_t *pte;
+    struct PageInfo *pg;
+
+    *pg_store = NULL;
+    if((uint32_t)srcva>=UTOP) return 0;
+    // srcva not page aligned
+    if(PGOFF(srcva)) return -E_INVAL;
+    // perm wrong
+    int set_mask = (PTE_U|PTE_P);
+    if((~perm)&set_mask) return -E_INVAL;
+    if(perm&(~PTE_SYSCALL)) return -E_INVAL;
+    // srcva not mapped
+    pg = page_lookup(srcenv->env_pgdir, srcva, &pte);
+    if(pg==NULL) return -E_INVAL;
+    // srcva read-only
+    if((perm&PTE_W) && !pte_writable(srcenv->env_pgdir, srcva, pte)) return -E_INVAL;
+    *pg_store = pg;
     return 0;
 }
 
+// Is 'dstenv' blocked in a receive that accepts a message from 'srcenv'?
+static bool
+ipc_receiving(struct Env *dstenv, struct Env *srcenv)
+{
+    return dstenv->env_ipc_recving && !dstenv->env_ipc_from &&
+           (!dstenv->env_ipc_recv_from ||
+            dstenv->env_ipc_recv_from == srcenv->env_id);
+}
+
+// Deliver 'value' (and the page at 'srcva', if any) from 'srcenv' to
+// 'dstenv', which must be blocked in sys_ipc_recv.  Fills in dstenv's
+// ipc fields as described for sys_ipc_try_send, but leaves it to the
+// caller to make dstenv runnable.
+//
+// Returns 0 on success, < 0 on error, in which case dstenv is untouched.
+// Errors are the ones from ipc_check_page, plus
+//	-E_NO_MEM if there's not enough memory to map srcva in dstenv.
+static int
+ipc_deliver(struct Env *srcenv, struct Env *dstenv, uint32_t value,
+	    void *srcva, unsigned perm)
+{
+    struct PageInfo *pg;
+    bool mapped = 0;
+    int r;
+
+    pgdir_lock_pair(srcenv->env_pgdir, dstenv->env_pgdir);
+    if((r=ipc_check_page(srcenv, srcva, perm, &pg))==0 && pg
+       && (uint32_t)(dstenv->env_ipc_dstva)<UTOP){//willing to receive page map
+        if(page_insert(dstenv->env_pgdir,pg,dstenv->env_ipc_dstva,perm)<0) r = -E_NO_MEM;
+        else mapped = 1;
+    }
+    pgdir_unlock_pair(srcenv->env_pgdir, dstenv->env_pgdir);
+    if(r<0) return r;
+    dstenv->env_ipc_perm = mapped ? perm : 0;
+    dstenv->env_ipc_recving = 0;
+    dstenv->env_ipc_recv_from = 0;
+    dstenv->env_ipc_from = srcenv->env_id;
+    dstenv->env_ipc_value = value;
+
+    // Answering the caller we were serving ends the priority loan.
+    if(srcenv->env_ipc_client==dstenv->env_id){
+        srcenv->env_ipc_client = 0;
+        env_inherit_priority(srcenv);
+    }
+    return 0;
+}
+
+// 'server' just received a call from 'client': it runs with at least
+// the client's priority until it replies.
+static void
+ipc_lend_priority(struct Env *server, struct Env *client)
+{
+    server->env_ipc_client = client->env_id;
+    env_inherit_priority(server);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -327,40 +612,127 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
-    pte_t *pte;
-    struct PageInfo *pg;
-    // Error #1: -E_BAD_ENV
     struct Env *e;
+    int r;
+    // Error #1: -E_BAD_ENV
     // No need to check permissions
-    if(envid2env(envid,&e,0)<0) return -E_BAD_ENV;
+    if(envid2env_lock_curenv(envid,&e)<0) return -E_BAD_ENV;
     // Error #2: -E_IPC_NOT_RECV
-    if(!e->env_ipc_recving || e->env_ipc_from) return -E_IPC_NOT_RECV;
-    if((uint32_t)srcva<UTOP){
-        // Error #3: -E_INVAL(srcva not page aligned)
-        if(PGOFF(srcva)) return -E_INVAL;
-        // Error #4: -E_INVAL(perm wrong)
-        int set_mask = (PTE_U|PTE_P);
-        if((~perm)&set_mask) return -E_INVAL;
-        if(perm&(~PTE_SYSCALL)) return -E_INVAL;
-        // Error #5: -E_INVAL(srcva not mapped)
-        pg = page_lookup(curenv->env_pgdir, srcva, &pte);
-        if(pg==NULL) return -E_INVAL;
-        // Error #6: -E_INVAL(srcva read-only)
-        if((perm&PTE_W) && !(*pte&PTE_W)) return -E_INVAL;
-        // Error #7: -E_NO_MEM
-        if((uint32_t)(e->env_ipc_dstva)<UTOP){//willing to receive page map
-            if(page_insert(e->env_pgdir,pg,e->env_ipc_dstva,perm)<0) return -E_NO_MEM;
-            e->env_ipc_perm = perm;
+    // Errors #3 - #7: bad page or perm, or no memory to map it
+    if(!ipc_receiving(e,curenv)) r = -E_IPC_NOT_RECV;
+    else if((r=ipc_deliver(curenv,e,value,srcva,perm))==0){
+        // Syscall returns 0
+        e->env_tf.tf_regs.reg_eax = 0;
+        sched_wakeup(e);
+    }
+    env_unlock_pair(curenv,e);
+    return r;
+}
+
+// Send 'value' (and the page at 'srcva', if srcva < UTOP) to 'envid',
+// blocking until the target receives it.
+//
+// If the target is already waiting in sys_ipc_recv, the message is
+// delivered at once, exactly as sys_ipc_try_send would.  Otherwise the
+// caller is appended to the target's FIFO send queue and put to sleep;
+// the target's next sys_ipc_recv picks it off the queue, completes the
+// transfer and makes the caller runnable again without ever leaving the
+// kernel.  This replaces the user-space try_send/sys_yield retry loop.
+//
+// Returns 0 once the message has been delivered, < 0 on error.
+// Errors are the same as for sys_ipc_try_send (except -E_IPC_NOT_RECV),
+// plus:
+//	-E_BAD_ENV if the target is destroyed while we are queued on it.
+//	-E_INVAL if envid is the caller itself.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    struct PageInfo *pg;
+    struct Env *e;
+    int r;
+
+    env_ipc_unqueue(curenv);
+    if(envid2env_lock_curenv(envid,&e)<0) return -E_BAD_ENV;
+    if(e==curenv) r = -E_INVAL;
+    else if((r=ipc_check_page(curenv,srcva,perm,&pg))<0) ;
+    else if(ipc_receiving(e,curenv)){
+        if((r=ipc_deliver(curenv,e,value,srcva,perm))==0){
+            e->env_tf.tf_regs.reg_eax = 0;
+            sched_wakeup(e);
         }
+    } else {
+        // Queue up behind any earlier senders and sleep until the target
+        // receives; whoever dequeues us stores our return value in eax.
+        curenv->env_ipc_send_value = value;
+        curenv->env_ipc_send_srcva = srcva;
+        curenv->env_ipc_send_perm = perm;
+        curenv->env_ipc_calling = 0;
+        env_ipc_enqueue(e,curenv);
+        env_inherit_priority(e);
+        sched_suspend(curenv);
+        env_unlock_pair(curenv,e);
+        sched_yield();
     }
-    // Set target's ipc fields
-    e->env_ipc_recving = 0;
-    e->env_ipc_from = curenv->env_id;
-    e->env_ipc_value = value;
-    e->env_status = ENV_RUNNABLE;
-    // Syscall returns 0
-    e->env_tf.tf_regs.reg_eax = 0;
-    return 0;
+    env_unlock_pair(curenv,e);
+    return r;
+}
+
+// Send 'value' (and the page at 'srcva', if srcva < UTOP) to 'envid' as
+// sys_ipc_send does, then block until 'envid' replies, all in a single
+// system call.  The reply is received exactly as by sys_ipc_recv(dstva),
+// except that only 'envid' may send it: messages from anyone else queue
+// up until our next sys_ipc_recv.
+//
+// Returns 0 once the reply has arrived (the reply itself is in our ipc
+// fields), < 0 on error.  Errors are the ones of sys_ipc_send, plus
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_BAD_ENV if envid is destroyed before it replies.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+    struct PageInfo *pg;
+    struct Env *e;
+    int r;
+
+    if((uint32_t)dstva<UTOP&&PGOFF(dstva)) return -E_INVAL;
+    env_ipc_unqueue(curenv);
+    if(envid2env_lock_curenv(envid,&e)<0) return -E_BAD_ENV;
+    if(e==curenv) r = -E_INVAL;
+    else r = ipc_check_page(curenv,srcva,perm,&pg);
+    if(r<0){
+        env_unlock_pair(curenv,e);
+        return r;
+    }
+
+    // Set up the receive for the reply before the request can possibly
+    // reach the server, so that the reply can never miss us.
+    curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_from = 0;
+    curenv->env_ipc_recv_from = e->env_id;
+
+    if(ipc_receiving(e,curenv)){
+        if((r=ipc_deliver(curenv,e,value,srcva,perm))<0){
+            curenv->env_ipc_recv_from = 0;
+            env_unlock_pair(curenv,e);
+            return r;
+        }
+        e->env_tf.tf_regs.reg_eax = 0;
+        sched_wakeup(e);
+        curenv->env_ipc_recving = true;
+        ipc_lend_priority(e,curenv);
+    } else {
+        // Whoever dequeues us switches us over to receiving the reply.
+        curenv->env_ipc_send_value = value;
+        curenv->env_ipc_send_srcva = srcva;
+        curenv->env_ipc_send_perm = perm;
+        curenv->env_ipc_calling = 1;
+        env_ipc_enqueue(e,curenv);
+        env_inherit_priority(e);
+    }
+    sched_suspend(curenv);
+    env_unlock_pair(curenv,e);
+    sched_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -370,6 +742,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If some environment is already blocked in sys_ipc_send to us, the
+// first one in line is dequeued and its message delivered right away,
+// without blocking.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
@@ -378,21 +754,89 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
+    struct Env *e = curenv, *s;
+    int r;
+
     if((uint32_t)dstva<UTOP&&PGOFF(dstva)){
         return -E_INVAL;
     }
-    envid_t envid = sys_getenvid();
-    struct Env *e;
-    int r=envid2env(envid,&e,0);
-    if(r<0) return r;
-    e->env_ipc_recving = true;
+    env_lock(e);
     e->env_ipc_dstva = dstva;
     e->env_ipc_from = 0;
-    e->env_status = ENV_NOT_RUNNABLE;
+
+    e->env_ipc_recv_from = 0;
+    // Taking the next request ends any loan from an unanswered call.
+    e->env_ipc_client = 0;
+
+    // env_ipc_recving stays clear while we drain the queue (which may
+    // briefly drop our lock), so new senders queue up behind.
+    while((s=env_lock_first(e,&e->env_ipc_sendq))!=NULL){
+        env_ipc_dequeue(e);
+        r = ipc_deliver(s,e,s->env_ipc_send_value,
+                        s->env_ipc_send_srcva,s->env_ipc_send_perm);
+        if(r==0 && s->env_ipc_calling){
+            // Request delivered; the caller now waits for our reply.
+            s->env_ipc_calling = 0;
+            s->env_ipc_recving = true;
+            ipc_lend_priority(e,s);
+            env_unlock_pair(e,s);
+            return 0;
+        }
+        s->env_ipc_calling = 0;
+        s->env_ipc_recv_from = 0;
+        s->env_tf.tf_regs.reg_eax = r;
+        sched_wakeup(s);
+        env_unlock(s);
+        if(r==0){
+            env_inherit_priority(e);
+            env_unlock(e);
+            return 0;
+        }
+    }
+    env_inherit_priority(e);
+
+    e->env_ipc_recving = true;
+    sched_suspend(e);
+    env_unlock(e);
     sys_yield();
 	return 0;
 }
 
+// Reply to 'envid' with 'value' (and the page at 'srcva', if srcva < UTOP),
+// then block for the next message exactly as sys_ipc_recv(dstva) does.
+// This is the server half of sys_ipc_call.
+//
+// The reply never blocks: if 'envid' is 0, gone, or not waiting for a
+// message from us, it is silently dropped so that a misbehaving client
+// cannot stall the server.  If the reply cannot be delivered (bad page
+// or perm, out of memory) the client's call fails with that error.
+//
+// Returns < 0 on error, and 0 when the next message has arrived.
+// Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+    struct Env *e;
+    int r;
+
+    if((uint32_t)dstva<UTOP&&PGOFF(dstva)) return -E_INVAL;
+    if(envid && envid2env_lock_curenv(envid,&e)==0){
+        if(e!=curenv && ipc_receiving(e,curenv)){
+            if((r=ipc_deliver(curenv,e,value,srcva,perm))<0){
+                e->env_ipc_recving = 0;
+                e->env_ipc_recv_from = 0;
+            }
+            e->env_tf.tf_regs.reg_eax = r;
+            sched_wakeup(e);
+        }
+        env_unlock_pair(curenv,e);
+    }
+    return sys_ipc_recv(dstva);
+}
+
+// Move the page at 'src' to 'dst' in curenv, which must be locked.
 int move_page(void* src, void* dst, int perm){
     struct PageInfo * pg;
     int r;
@@ -412,6 +856,12 @@ sys_exec(uint32_t eip, uint32_t esp, void * v_ph, uint32_t phnum)
 
     // Program segment
 	struct Proghdr * ph = (struct Proghdr *) v_ph; 
+	env_lock(curenv);
+	// Other threads would be left running in a program that's gone.
+	if (pa2page(PADDR(curenv->env_pgdir))->pp_ref > 1) {
+		env_unlock(curenv);
+		return -E_INVAL;
+	}
 	for (int i = 0; i < phnum; i++, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
@@ -421,13 +871,18 @@ sys_exec(uint32_t eip, uint32_t esp, void * v_ph, uint32_t phnum)
 
 		end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
 		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va != end; tmp_map += PGSIZE, va += PGSIZE) {
-            if (( r =move_page((void*) tmp_map, (void*) va, perm))) return r;
+            if (( r =move_page((void*) tmp_map, (void*) va, perm))) {
+                env_unlock(curenv);
+                return r;
+            }
 		}
 	}
 
     // Stack segment
     perm = PTE_P|PTE_U|PTE_W;
-    if ((r=move_page((void*) tmp_map, (void*) (USTACKTOP - PGSIZE), perm))) return r;
+    r = move_page((void*) tmp_map, (void*) (USTACKTOP - PGSIZE), perm);
+    env_unlock(curenv);
+    if (r) return r;
 
 	curenv->env_tf.tf_eip = eip;
 	curenv->env_tf.tf_esp = esp;
@@ -436,6 +891,247 @@ sys_exec(uint32_t eip, uint32_t esp, void * v_ph, uint32_t phnum)
 	return 0;
 }
 
+// Find the futex key (see kern/futex.c) of the word at 'addr' in e,
+// whose page directory must be locked along with e, and where the
+// kernel can read the word.
+static int
+futex_key(struct Env *e, uint32_t *addr, pde_t **pgdir_store,
+          uintptr_t *key_store, volatile uint32_t **word_store)
+{
+    struct PageInfo *pp;
+    pte_t *pte;
+
+    if ((uintptr_t) addr >= UTOP || (uintptr_t) addr % 4)
+        return -E_INVAL;
+    pp = page_lookup(e->env_pgdir, addr, &pte);
+    if (!pp || !(*pte & PTE_U))
+        return -E_INVAL;
+    if (*pte & PTE_SHARE) {
+        *pgdir_store = NULL;
+        *key_store = page2pa(pp) + PGOFF(addr);
+    } else {
+        *pgdir_store = e->env_pgdir;
+        *key_store = (uintptr_t) addr | 1;
+    }
+    *word_store = (uint32_t *) ((char *) page2kva(pp) + PGOFF(addr));
+    return 0;
+}
+
+// Sleep until some env calls sys_futex_wake on the word at 'addr',
+// provided the word still holds 'expected'.  Envs sharing the page
+// (PTE_SHARE pages, threads) can wake each other this way.  Sleepers
+// are also woken when a PTE_SHARE mapping of their page goes away, and
+// don't go to sleep if one went away anywhere since our previous system
+// call: see futex_wait.  Either way the caller must look again before
+// sleeping again.
+//
+// Returns 0 once woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is above UTOP, is not 4-byte aligned, or is not
+//		mapped user-readable.
+//	-E_AGAIN if the word does not hold 'expected', or a PTE_SHARE
+//		mapping went away.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, uint32_t gen)
+{
+    pde_t *pgdir;
+    uintptr_t key;
+    volatile uint32_t *word;
+    int r;
+
+    futex_cancel(curenv);
+    env_lock(curenv);
+    pgdir_lock(curenv->env_pgdir);
+    if ((r = futex_key(curenv, addr, &pgdir, &key, &word)) == 0)
+        r = futex_wait(pgdir, key, word, expected, gen);
+    pgdir_unlock(curenv->env_pgdir);
+    env_unlock(curenv);
+    if (r < 0)
+        return r;
+    sched_yield();
+}
+
+// Wake up to 'n' envs sleeping in sys_futex_wait on the word at 'addr',
+// the longest-sleeping first.
+//
+// Returns the number of envs woken, < 0 on error.  Errors are the ones
+// from sys_futex_wait, except -E_AGAIN.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+    pde_t *pgdir;
+    uintptr_t key;
+    volatile uint32_t *word;
+    int r;
+
+    env_lock(curenv);
+    pgdir_lock(curenv->env_pgdir);
+    r = futex_key(curenv, addr, &pgdir, &key, &word);
+    pgdir_unlock(curenv->env_pgdir);
+    env_unlock(curenv);
+    if (r < 0)
+        return r;
+    return futex_wake(pgdir, key, n);
+}
+
+// Send the environment 'envid' the notification bits 'bits', waking it
+// if it is blocked in sys_notify_wait on any of them.  Bits stay set
+// until the target waits for them, so none are lost if it is busy; a
+// bit sent twice before then is seen once.  Any environment may notify
+// any other.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if bits has bit 31 set.
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+    struct Env *e;
+    int r;
+
+    if (bits & ~NOTIFY_ALL)
+        return -E_INVAL;
+    if ((r = envid2env_lock(envid, &e, 0)) < 0)
+        return r;
+    env_notify(e, bits);
+    env_unlock(e);
+    return 0;
+}
+
+// Block until any of the notification bits in 'mask' is set, then clear
+// those that are and return them.  Returns at once if one already is.
+//
+// Returns the bits taken (> 0), or < 0 on error.  Errors are:
+//	-E_INVAL if mask is 0 or has bit 31 set.
+static int
+sys_notify_wait(uint32_t mask)
+{
+    uint32_t ready;
+
+    if (!mask || (mask & ~NOTIFY_ALL))
+        return -E_INVAL;
+    env_lock(curenv);
+    if ((ready = curenv->env_notify & mask)) {
+        curenv->env_notify &= ~ready;
+        env_unlock(curenv);
+        return ready;
+    }
+    curenv->env_notify_mask = mask;
+    sched_suspend(curenv);
+    env_unlock(curenv);
+    sched_yield();
+}
+
+// Reserve [va, va+len) in our address space as an anonymous region: its
+// pages are not mapped now, but each is mapped, zeroed and with
+// permissions 'perm', the first time it is touched, by the kernel's page
+// fault handler rather than our page fault upcall.  Pages already mapped
+// in the range, and pages later unmapped from it, are left to that too.
+// The region is shared by our threads and copied by sys_fork; it lasts
+// as long as the address space.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, len is 0, or the range is not
+//		below UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc), or has
+//		PTE_COW set.
+//	-E_INVAL if the range overlaps a region reserved before.
+//	-E_NO_MEM if there's no memory to record the region.
+static int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+    len = ROUNDUP(len, PGSIZE);
+    if (PGOFF(va) || len == 0 || (uintptr_t) va >= UTOP
+        || len > UTOP - (uintptr_t) va)
+        return -E_INVAL;
+    if ((perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P)
+        || (perm & ~PTE_SYSCALL) || (perm & PTE_COW))
+        return -E_INVAL;
+    return region_reserve(curenv->env_pgdir, (uintptr_t) va, len, perm);
+}
+
+// Run the system calls queued in the submission ring at 'ring' (see
+// inc/syscall.h), in order, posting each return value to the completion
+// ring.  Stops when the submission ring is empty, the completion ring is
+// full, or a call fails; a failed call's result is still posted, and the
+// entries after it are left queued.  Queued calls that are not allowed
+// in a ring fail with -E_INVAL, and a queued sys_env_set_trapframe with
+// a bad trapframe fails with -E_FAULT instead of destroying the caller.
+//
+// The ring page is pinned for the duration, so a queued call that unmaps
+// it cannot pull it out from under us.
+//
+// Returns the number of calls run, or
+//	-E_INVAL if ring is above UTOP, crosses a page boundary, or is not
+//		mapped user-writable.
+static int
+sys_ring_enter(struct SysRing *ring)
+{
+    struct Env *e;
+    struct PageInfo *pp;
+    pte_t *pte;
+    struct SysRing *kr;
+    struct SysRingEntry sqe;
+    uint32_t head, ctail;
+    int n, r;
+
+    if ((uint32_t) ring >= UTOP || PGOFF(ring) + sizeof(*ring) > PGSIZE)
+        return -E_INVAL;
+    if ((r = envid2env_lock(0, &e, 0)) < 0)
+        return r;
+    pgdir_lock(e->env_pgdir);
+    pp = page_lookup(e->env_pgdir, ring, &pte);
+    if (pp && !pte_writable(e->env_pgdir, ring, pte)
+        && page_cow_break(e->env_pgdir, ring) == 0)
+        pp = page_lookup(e->env_pgdir, ring, &pte);
+    if (!pp || !(*pte & PTE_U) || !pte_writable(e->env_pgdir, ring, pte)) {
+        pgdir_unlock(e->env_pgdir);
+        env_unlock(e);
+        return -E_INVAL;
+    }
+    page_incref(pp);
+    pgdir_unlock(e->env_pgdir);
+    env_unlock(e);
+    kr = (struct SysRing *) ((char *) page2kva(pp) + PGOFF(ring));
+
+    head = kr->sq_head;
+    ctail = kr->cq_tail;
+    n = 0;
+    while (head != kr->sq_tail && ctail - kr->cq_head < SYSRING_SIZE) {
+        sqe = kr->sq[head++ % SYSRING_SIZE];
+        switch (sqe.num) {
+        case SYS_env_set_trapframe:
+            // A bad trapframe would destroy us without returning, and
+            // leave the ring page pinned: fail the call instead.
+            if (user_mem_check(curenv, (void *) sqe.args[1],
+                               sizeof(struct Trapframe), PTE_U) < 0) {
+                r = -E_FAULT;
+                break;
+            }
+            /* fall through */
+        case SYS_page_alloc:
+        case SYS_page_map:
+        case SYS_page_unmap:
+        case SYS_env_set_priority:
+        case SYS_env_set_status:
+        case SYS_env_set_pgfault_upcall:
+            r = syscall(sqe.num, sqe.args[0], sqe.args[1], sqe.args[2],
+                        sqe.args[3], sqe.args[4]);
+            break;
+        default:
+            r = -E_INVAL;
+        }
+        kr->cq[ctail++ % SYSRING_SIZE] = r;
+        n++;
+        if (r < 0)
+            break;
+    }
+    kr->sq_head = head;
+    kr->cq_tail = ctail;
+
+    page_decref(pp);
+    return n;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -443,6 +1139,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
+    // For sys_futex_wait: the generation as of the previous call.
+    uint32_t futex_gen = curenv->env_futex_gen;
+    curenv->env_futex_gen = futex_unmap_gen;
 
 	switch (syscallno) {
         case SYS_cputs:
@@ -459,6 +1158,8 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return 0;
         case SYS_exofork:
             return sys_exofork();
+        case SYS_fork:
+            return sys_fork();
         case SYS_env_set_priority:
             return sys_env_set_priority(a1,a2);
         case SYS_env_set_status:
@@ -475,10 +1176,32 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_ipc_recv((void*)a1);
         case SYS_ipc_try_send:
             return sys_ipc_try_send(a1,a2,(void*)a3,a4);
+        case SYS_ipc_send:
+            return sys_ipc_send(a1,a2,(void*)a3,a4);
+        case SYS_env_wait:
+            return sys_env_wait(a1);
+        case SYS_ipc_call:
+            return sys_ipc_call(a1,a2,(void*)a3,a4,(void*)a5);
+        case SYS_ipc_reply_wait:
+            return sys_ipc_reply_wait(a1,a2,(void*)a3,a4,(void*)a5);
 		case SYS_env_set_trapframe:
         	return sys_env_set_trapframe(a1, (struct Trapframe *) a2);
         case SYS_exec:
             return sys_exec(a1,a2,(void*)a3,a4);
+        case SYS_ring_enter:
+            return sys_ring_enter((struct SysRing *)a1);
+        case SYS_thread_create:
+            return sys_thread_create(a1, a2, a3);
+        case SYS_futex_wait:
+            return sys_futex_wait((uint32_t *)a1, a2, futex_gen);
+        case SYS_futex_wake:
+            return sys_futex_wake((uint32_t *)a1, (int)a2);
+        case SYS_notify:
+            return sys_notify(a1, a2);
+        case SYS_notify_wait:
+            return sys_notify_wait(a1);
+        case SYS_region_reserve:
+            return sys_region_reserve((void *)a1, a2, a3);
     	default:
 	    	return -E_INVAL;
 	}
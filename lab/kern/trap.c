@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -13,6 +14,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/region.h>
 
 //static struct Taskstate ts;
 
@@ -22,6 +24,15 @@
  */
 static struct Trapframe *last_tf;
 
+// The EFLAGS bits a user env may set for itself (with popf) and carry
+// through sysenter.
+#define FL_USER	(FL_CF|FL_PF|FL_AF|FL_ZF|FL_SF|FL_TF|FL_DF|FL_OF|FL_AC)
+
+extern void sysenter_handler();
+struct Trapframe *sysenter_trap(uint32_t num, uint32_t a1, uint32_t a2,
+				uint32_t a3, uint32_t a4, uint32_t eip,
+				uint32_t esp, uint32_t eflags);
+
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
  */
@@ -71,7 +82,7 @@ trap_init(void)
     extern struct Segdesc gdt[];
 
     extern uint32_t vectors[];
-    for(int i=0;i<=T_SYSCALL;i++){
+    for(int i=0;i<=T_TLBFLUSH;i++){
         int dpl=0;
         if(i==T_BRKPT||i==T_SYSCALL) dpl=3;
         SETGATE(idt[i],0,GD_KT,vectors[i],dpl);
@@ -128,6 +139,16 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// The sysenter fast path enters on the same kernel stack.
+	// sysexit returns to CS = MSR_SYSENTER_CS + 16 and SS = + 24,
+	// which the GDT layout makes GD_UT and GD_UD.
+	if (cpu_has_sysenter()) {
+		static_assert(GD_UT == GD_KT + 16 && GD_UD == GD_KT + 24);
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, cputs->ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -181,7 +202,6 @@ trap_dispatch(struct Trapframe *tf)
 {
 	// Handle processor exceptions.
 	// LAB 3: Your code here.
-    uint32_t ret;
     switch(tf->tf_trapno){
         case T_PGFLT: //page fault
             page_fault_handler(tf);
@@ -190,7 +210,8 @@ trap_dispatch(struct Trapframe *tf)
             monitor(tf);
             return;
         case T_SYSCALL: //system call
-            ret=
+            // Errors, like any other result, go back to the caller.
+            tf->tf_regs.reg_eax=
             syscall(
                 tf->tf_regs.reg_eax,//system call number
                 tf->tf_regs.reg_edx,
@@ -199,16 +220,20 @@ trap_dispatch(struct Trapframe *tf)
                 tf->tf_regs.reg_edi,
                 tf->tf_regs.reg_esi
                 );
-            if(ret<0){
-                panic("system call invalid in trap_dispatch: %e\n",ret);
-            }
-            tf->tf_regs.reg_eax=ret;
+            return;
+        case T_RESCHED: //another CPU made an env runnable for us
+            lapic_eoi();
+            sched_yield();
+        case T_TLBFLUSH: //flushed on the way in; see tlb_flush
+            lapic_eoi();
             return;
         case IRQ_OFFSET+IRQ_KBD:
             kbd_intr();
+            cons_notify();
             return;
         case IRQ_OFFSET+IRQ_SERIAL:
             serial_intr();
+            cons_notify();
             return;
         default:
             break;
@@ -239,6 +264,7 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_cs == GD_KT)
 		panic("unhandled trap in kernel");
 	else {
+		curenv->env_exit_status = -E_FAULT;
 		env_destroy(curenv);
 		return;
 	}
@@ -256,22 +282,31 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
+	// Leave the idle set if we were halted in sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+		sched_unidle();
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// sysenter does not clear TF, so a sysenter made with TF set traps
+	// before sysenter_handler's first instruction, with the syscall
+	// registers still intact.  Make the call from here; sysenter_trap
+	// returns it by iret, as it does any single-stepped env.
+	if (tf->tf_trapno == T_DEBUG
+	    && tf->tf_eip == (uintptr_t) sysenter_handler)
+		sysenter_trap(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx,
+			      tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx,
+			      tf->tf_regs.reg_edi, tf->tf_regs.reg_esi,
+			      tf->tf_regs.reg_ebp, tf->tf_eflags);
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-        lock_kernel();
+		// There is no big kernel lock to take: kernel code locks
+		// just the envs, pages or devices it works on.
 		assert(curenv);
+		tlb_enter_kernel();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -305,6 +340,59 @@ trap(struct Trapframe *tf)
 }
 
 
+// Called from sysenter_handler in trapentry.S, with interrupts off, for
+// a system call made through sysenter.  Records the caller's registers
+// in curenv->env_tf exactly as an int $T_SYSCALL would have left them,
+// then dispatches straight to syscall() without trap_dispatch.  Returns
+// the trapframe if curenv may go straight back to user mode by sysexit;
+// otherwise, like trap(), hands the CPU to the scheduler.
+struct Trapframe *
+sysenter_trap(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+              uint32_t a4, uint32_t eip, uint32_t esp, uint32_t eflags)
+{
+    struct Trapframe *tf;
+
+    extern char *panicstr;
+    if (panicstr)
+        asm volatile("hlt");
+    tlb_enter_kernel();
+
+    if (curenv->env_status == ENV_DYING) {
+        env_free(curenv);
+        curenv = NULL;
+        sched_yield();
+    }
+
+    // CS, SS, DS and ES keep the user values env_alloc gave them.
+    tf = &curenv->env_tf;
+    tf->tf_regs.reg_eax = num;
+    tf->tf_regs.reg_edx = a1;
+    tf->tf_regs.reg_ecx = a2;
+    tf->tf_regs.reg_ebx = a3;
+    tf->tf_regs.reg_edi = a4;
+    tf->tf_regs.reg_esi = eip;
+    tf->tf_regs.reg_ebp = esp;
+    tf->tf_trapno = T_SYSCALL;
+    tf->tf_err = 0;
+    tf->tf_eip = eip;
+    tf->tf_esp = esp;
+    // Only the user's own flags; the IOPL an env was given stays.
+    tf->tf_eflags = (eflags & FL_USER) | (tf->tf_eflags & FL_IOPL_MASK)
+        | FL_IF;
+    last_tf = tf;
+
+    tf->tf_regs.reg_eax = syscall(num, a1, a2, a3, a4, 0);
+
+    if (curenv && curenv->env_status == ENV_RUNNING) {
+        // sysexit can't restore TF without trapping in the kernel.
+        if (tf->tf_eflags & FL_TF)
+            env_run(curenv);
+        tlb_leave_kernel();
+        return tf;
+    }
+    sched_yield();
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -325,6 +413,26 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+    // Writes to copy-on-write pages (see sys_fork) are resolved right
+    // here, without a round trip through a user-level handler.
+    if ((tf->tf_err & (FEC_PR|FEC_WR)) == (FEC_PR|FEC_WR) && fault_va < UTOP) {
+        int r;
+
+        env_lock(curenv);
+        pgdir_lock(curenv->env_pgdir);
+        r = page_cow_break(curenv->env_pgdir, (void *) fault_va);
+        pgdir_unlock(curenv->env_pgdir);
+        env_unlock(curenv);
+        if (r == 0)
+            return;
+    }
+
+    // So are first touches of pages in anonymous regions (see
+    // sys_region_reserve).
+    if (!(tf->tf_err & FEC_PR)
+        && region_fault(curenv->env_pgdir, fault_va) == 0)
+        return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -357,22 +465,38 @@ page_fault_handler(struct Trapframe *tf)
 	// LAB 4: Your code here.
     if(curenv->env_pgfault_upcall){
         // In case it has been initialized
+        // Each thread has its own exception stack (see sys_thread_create).
+        uint32_t uxstacktop = curenv->env_uxstacktop;
         uint32_t new_esp;
-        if(tf->tf_esp<UXSTACKTOP-PGSIZE||tf->tf_esp>=UXSTACKTOP){
-            new_esp = UXSTACKTOP-sizeof(struct UTrapframe);
+        if(tf->tf_esp<uxstacktop-PGSIZE||tf->tf_esp>=uxstacktop){
+            new_esp = uxstacktop-sizeof(struct UTrapframe);
         }
         else{
             new_esp = tf->tf_esp-sizeof(struct UTrapframe)-8;
         }
+        // Only the thread that forked got a fresh exception stack in the
+        // child; the others' became copy-on-write in the parent.
+        if(user_mem_check(curenv,(void*)new_esp,sizeof(struct UTrapframe),PTE_U|PTE_W)<0){
+            env_lock(curenv);
+            pgdir_lock(curenv->env_pgdir);
+            page_cow_break(curenv->env_pgdir,(void*)(uxstacktop-PGSIZE));
+            pgdir_unlock(curenv->env_pgdir);
+            env_unlock(curenv);
+        }
         user_mem_assert(curenv,(void*)new_esp,sizeof(struct UTrapframe),PTE_U|PTE_W|PTE_P);
-        struct UTrapframe* utrap;
-        utrap = (struct UTrapframe *)new_esp;
-        utrap->utf_esp = tf->tf_esp;
-        utrap->utf_eflags = tf->tf_eflags;
-        utrap->utf_eip = tf->tf_eip;
-        utrap->utf_regs = tf->tf_regs;
-        utrap->utf_err = tf->tf_err;
-        utrap->utf_fault_va = fault_va;
+        struct UTrapframe utrap;
+        utrap.utf_esp = tf->tf_esp;
+        utrap.utf_eflags = tf->tf_eflags;
+        utrap.utf_eip = tf->tf_eip;
+        utrap.utf_regs = tf->tf_regs;
+        utrap.utf_err = tf->tf_err;
+        utrap.utf_fault_va = fault_va;
+        // Another thread may unmap the exception stack under us.
+        if(user_mem_copyout(curenv,(void*)new_esp,&utrap,sizeof(utrap))<0){
+            curenv->env_exit_status = -E_FAULT;
+            env_destroy(curenv);
+            return;
+        }
 
         tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
         tf->tf_esp = new_esp;
@@ -380,9 +504,13 @@ page_fault_handler(struct Trapframe *tf)
     }
 
 	// Destroy the environment that caused the fault.
+	if (fault_va < USTACKTOP - USTACKSIZE
+	    && fault_va >= USTACKTOP - USTACKSIZE - PGSIZE)
+		cprintf("[%08x] user stack overflow\n", curenv->env_id);
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	curenv->env_exit_status = -E_FAULT;
 	env_destroy(curenv);
 }
 
@@ -83,8 +83,9 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
+	// Sleep until the kernel tells us input has arrived.
 	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+		sys_notify_wait(NOTIFY_CONS);
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
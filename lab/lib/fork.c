@@ -1,181 +1,51 @@
-// implement fork from user space
+// fork() on top of the kernel's copy-on-write sys_fork
 
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
-//
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
-//
-static void
-pgfault(struct UTrapframe *utf)
-{
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-	int r;
-
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	// Hint:
-	//   Use the read-only page table mappings at uvpt
-	//   (see <inc/memlayout.h>).
-
-	// LAB 4: Your code here.
-    if((err&FEC_WR)==0) panic("pgfault: not a write");
-    if((uvpt[PGNUM(addr)]&PTE_COW)==0) panic("pgfault: now in a COW page");
-
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	// Hint:
-	//   You should make three system calls.
-
-	// LAB 4: Your code here.
-
-    envid_t envid = sys_getenvid();
-    r=sys_page_alloc(envid,(void*)PFTEMP,PTE_P|PTE_W|PTE_U);
-    if(r<0) panic("pgfault: sys_page_alloc failed: %e",r);
-    addr = ROUNDDOWN(addr,PGSIZE);
-    // Copy from addr to PFTEMP
-    memmove(PFTEMP,addr,PGSIZE);
-
-    r=sys_page_map(envid,PFTEMP,envid,addr,PTE_P|PTE_W|PTE_U);
-    if(r<0) panic("pgfault: map failed: %e",r);
-    r=sys_page_unmap(envid,PFTEMP);
-    if(r<0) panic("pgfault: unmap failed: %e",r);
-}
-
-//
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-	// LAB 4: Your code here.
-    int perm = uvpt[pn]&0xfff;
-    envid_t curenvid = sys_getenvid();
-    void *addr=(void*)(pn*PGSIZE);
-    if(perm&PTE_SHARE){
-        r=sys_page_map(curenvid,addr,envid,addr,PTE_SYSCALL);
-        if(r<0) panic("duppage: SHARE, map failed: %e",r);
-    }
-    else if((perm&PTE_W)||(perm&PTE_COW)){
-        int dstperm = PTE_COW|PTE_U|PTE_P;
-        r=sys_page_map(curenvid,addr,envid,addr,dstperm);
-        if(r<0) panic("duppage: COW, envid map failed: %e",r);
-        r=sys_page_map(curenvid,addr,curenvid,addr,dstperm);
-        if(r<0) panic("duppage: COW, curenvid map failed: %e",r);
-    }
-    else{
-        r=sys_page_map(curenvid,addr,envid,addr,PTE_U|PTE_P);
-        if(r<0) panic("duppage: not COW, map failed: %e",r);
-    }
-	return 0;
-}
-
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.  The kernel's sys_fork copies the address
+// space, marking writable pages copy-on-write in both environments, and
+// resolves the resulting write faults itself, so no user-level page
+// fault handler is involved.  PTE_SHARE pages stay shared.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
-//
 envid_t
 fork(void)
 {
-	// LAB 4: Your code here.
-    set_pgfault_handler(pgfault);
-
-    envid_t envid = sys_exofork();
+    envid_t envid = sys_fork();
     if(envid<0){
-        panic("fork: sys_exofork failed: %e",envid);
+        panic("fork: sys_fork failed: %e",envid);
     }
     else if(envid==0){
         //child
         thisenv = &envs[ENVX(sys_getenvid())];
-        return 0;
-    }
-    else{
-        //parent
-        for(uint32_t addr=0;addr<USTACKTOP;addr+=PGSIZE){
-            if((uvpd[PDX(addr)]&PTE_P) && (uvpt[PGNUM(addr)]&PTE_P)){
-                duppage(envid,PGNUM(addr));
-            }
-        }
-        //exception stack
-        int r;
-        r=sys_page_alloc(envid,(void*)(UXSTACKTOP-PGSIZE),PTE_P|PTE_W|PTE_U);
-        if(r<0) panic("fork: sys_page_alloc failed: %e",r);
-        extern void _pgfault_upcall();
-        r=sys_env_set_pgfault_upcall(envid,_pgfault_upcall);
-        if(r<0) panic("fork: sys_env_set_pgfault_upcall failed: %e",r);
-        r=sys_env_set_status(envid,ENV_RUNNABLE);
-        if(r<0) panic("fork: sys_env_set_status failed: %e",r);
-        return envid;
     }
-    panic("fork panic");
+    return envid;
 }
 
 envid_t
 fork_with_priority(int priority)
 {
-	// LAB 4: Your code here.
-    set_pgfault_handler(pgfault);
-
-    envid_t envid = sys_exofork();
+    envid_t envid = sys_fork();
     if(envid<0){
-        panic("fork: sys_exofork failed: %e",envid);
+        panic("fork: sys_fork failed: %e",envid);
     }
     else if(envid==0){
         //child
         envid_t eid=sys_getenvid();
         thisenv = &envs[ENVX(eid)];
         sys_env_set_priority(eid,priority);
-        return 0;
-    }
-    else{
-        //parent
-        for(uint32_t addr=0;addr<USTACKTOP;addr+=PGSIZE){
-            if((uvpd[PDX(addr)]&PTE_P) && (uvpt[PGNUM(addr)]&PTE_P)){
-                duppage(envid,PGNUM(addr));
-            }
-        }
-        //exception stack
-        int r;
-        r=sys_page_alloc(envid,(void*)(UXSTACKTOP-PGSIZE),PTE_P|PTE_W|PTE_U);
-        if(r<0) panic("fork: sys_page_alloc failed: %e",r);
-        extern void _pgfault_upcall();
-        r=sys_env_set_pgfault_upcall(envid,_pgfault_upcall);
-        if(r<0) panic("fork: sys_env_set_pgfault_upcall failed: %e",r);
-        r=sys_env_set_status(envid,ENV_RUNNABLE);
-        if(r<0) panic("fork: sys_env_set_status failed: %e",r);
-        return envid;
     }
-    panic("fork panic");
+    return envid;
 }
-// Challenge!
+
+// Challenge!  A child sharing all of our memory but the stack can't
+// return from sfork() the way fork's child does, since the stack it
+// would return on is shared too; threads (see thread_create) start on
+// a stack of their own instead.
 int
 sfork(void)
 {
@@ -44,12 +44,12 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the message;
+// senders to the same environment are served in FIFO order.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -57,11 +57,58 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	// LAB 4: Your code here.
     int r;
     if(pg==NULL) pg=(void*)UTOP;
-    do{
-        r=sys_ipc_try_send(to_env,val,pg,perm);
-        if(r<0&&r!=-E_IPC_NOT_RECV) panic("ipc_send: send failed: %e\n",r);
-        sys_yield();
-    }while(r);
+    if((r=sys_ipc_send(to_env,val,pg,perm))<0)
+        panic("ipc_send: send failed: %e\n",r);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, in a single system call.  The reply is received as
+// by ipc_recv(NULL, rcv_pg, perm_store), except that only 'to_env' may
+// send it.
+// Returns the reply value, or the error if the system call fails (in
+// which case *perm_store is set to 0).
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_call(to_env, val, pg ? pg : (void*)UTOP, perm,
+			 rcv_pg ? rcv_pg : (void*)UTOP);
+	if (r < 0) {
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply to 'to_env' (if nonzero) with 'val' and 'pg'/'perm', then
+// receive the next message as ipc_recv(from_env_store, rcv_pg, perm_store)
+// would, in a single system call.  Used by servers answering ipc_call.
+// The reply is dropped if 'to_env' is not waiting for it.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_reply_wait(to_env, val, pg ? pg : (void*)UTOP, perm,
+			       rcv_pg ? rcv_pg : (void*)UTOP);
+	if (r < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -0,0 +1,279 @@
+// A user-space heap: malloc and free.
+//
+// The heap lives in [MBEGIN, MEND).  Small objects, up to MAXSMALL
+// bytes, are carved out of pages of one size class each; every such
+// page starts with a struct MPage and keeps a free list of its own, and
+// each class keeps a list of its pages that have free objects.  Larger
+// objects get a run of pages of their own, also headed by a struct
+// MPage.  Either way free() finds the header at the start of the page
+// an object begins in.
+//
+// Heap pages are allocated from a bitmap of the region, first fit, and
+// mapped and unmapped through the system call ring, so a large object
+// costs one trap however many pages it spans.  A small-object page is
+// unmapped once all its objects are free, unless it is the last page of
+// its class with free space.
+//
+// Threads share the heap, so it is guarded by a futex-based lock.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define MBEGIN		0x08000000
+#define MEND		0x10000000
+#define NMPAGE		((MEND - MBEGIN) / PGSIZE)
+
+struct MPage {
+	uint32_t mp_npages;	// Pages in a large object; 0 for small ones
+	uint32_t mp_class;	// Size class of the small objects
+	uint32_t mp_inuse;	// Small objects handed out
+	void *mp_free;		// Free small objects, linked by first word
+	struct MPage *mp_prev;	// On the class's list of pages with free
+	struct MPage *mp_next;	//   objects
+};
+
+#define MHDR		ROUNDUP(sizeof(struct MPage), 16)
+
+// Size classes: multiples of 16, spaced so that each fills its pages
+// (after the header) with little left over.
+static const uint16_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 672, 1008, 1344, 2032
+};
+#define NCLASS		ARRAY_SIZE(class_size)
+#define MAXSMALL	2032
+
+static uint8_t size_class[MAXSMALL / 16 + 1];	// By (size + 15) / 16
+static bool size_class_ready;
+static struct MPage *class_pages[NCLASS];	// Pages with free objects
+
+static uint32_t mpage_used[NMPAGE / 32];	// Bitmap of heap pages
+static uint32_t mpage_hint;			// No free page below this
+static size_t malloc_nmapped;			// Statistics
+static size_t malloc_ninuse;
+
+// 0: free, 1: held, 2: held and maybe waited for.
+static volatile uint32_t malloc_mutex;
+
+static void
+malloc_lock(void)
+{
+	uint32_t c;
+
+	if ((c = __sync_val_compare_and_swap(&malloc_mutex, 0, 1)) == 0)
+		return;
+	if (c != 2)
+		c = xchg(&malloc_mutex, 2);
+	while (c != 0) {
+		sys_futex_wait(&malloc_mutex, 2);
+		c = xchg(&malloc_mutex, 2);
+	}
+}
+
+static void
+malloc_unlock(void)
+{
+	if (xchg(&malloc_mutex, 0) == 2)
+		sys_futex_wake(&malloc_mutex, 1);
+}
+
+static bool
+mpage_isused(uint32_t i)
+{
+	return mpage_used[i / 32] & (1 << (i % 32));
+}
+
+static void
+mpage_mark(uint32_t i, uint32_t n, bool used)
+{
+	for (; n > 0; i++, n--)
+		if (used)
+			mpage_used[i / 32] |= 1 << (i % 32);
+		else
+			mpage_used[i / 32] &= ~(1 << (i % 32));
+}
+
+// Unmap the n heap pages at va, and make them available again.
+static void
+mpage_free(void *va, uint32_t n)
+{
+	uint32_t i = ((uintptr_t) va - MBEGIN) / PGSIZE, k;
+
+	for (k = 0; k < n; k++)
+		sysring_queue(SYS_page_unmap, 0, (uint32_t) va + k * PGSIZE,
+			      0, 0, 0);
+	sysring_flush();
+	mpage_mark(i, n, 0);
+	if (i < mpage_hint)
+		mpage_hint = i;
+	malloc_nmapped -= n;
+}
+
+// Find and map n consecutive free heap pages.  Returns their address, or
+// NULL if the heap is full or out of memory.
+static void *
+mpage_alloc(uint32_t n)
+{
+	uint32_t i, run, k;
+	void *va;
+
+	for (i = mpage_hint, run = 0; i < NMPAGE && run < n; i++)
+		run = mpage_isused(i) ? 0 : run + 1;
+	if (run < n)
+		return NULL;
+	i -= n;
+	if (i == mpage_hint)
+		mpage_hint = i + n;
+
+	va = (void *) (MBEGIN + i * PGSIZE);
+	mpage_mark(i, n, 1);
+	malloc_nmapped += n;
+	for (k = 0; k < n; k++)
+		sysring_queue(SYS_page_alloc, 0, (uint32_t) va + k * PGSIZE,
+			      PTE_P|PTE_U|PTE_W, 0, 0);
+	if (sysring_flush() < 0) {
+		mpage_free(va, n);
+		return NULL;
+	}
+	return va;
+}
+
+static void
+class_unlink(struct MPage *mp)
+{
+	if (mp->mp_prev)
+		mp->mp_prev->mp_next = mp->mp_next;
+	else
+		class_pages[mp->mp_class] = mp->mp_next;
+	if (mp->mp_next)
+		mp->mp_next->mp_prev = mp->mp_prev;
+	mp->mp_prev = mp->mp_next = NULL;
+}
+
+static void
+class_link(struct MPage *mp)
+{
+	mp->mp_prev = NULL;
+	if ((mp->mp_next = class_pages[mp->mp_class]) != NULL)
+		mp->mp_next->mp_prev = mp;
+	class_pages[mp->mp_class] = mp;
+}
+
+// Map a new page of objects of class c.
+static struct MPage *
+class_grow(int c)
+{
+	struct MPage *mp;
+	char *obj;
+
+	if ((mp = mpage_alloc(1)) == NULL)
+		return NULL;
+	mp->mp_npages = 0;
+	mp->mp_class = c;
+	mp->mp_inuse = 0;
+	mp->mp_free = NULL;
+	for (obj = (char *) mp + PGSIZE - class_size[c];
+	     obj >= (char *) mp + MHDR; obj -= class_size[c]) {
+		*(void **) obj = mp->mp_free;
+		mp->mp_free = obj;
+	}
+	class_link(mp);
+	return mp;
+}
+
+//
+// Allocate n bytes, aligned to 16 bytes.  Returns NULL if n is 0 or
+// there is no memory left.
+//
+void *
+malloc(size_t n)
+{
+	struct MPage *mp;
+	uint32_t npages;
+	void *v = NULL;
+	int c, i;
+
+	if (n == 0 || n > MEND - MBEGIN)
+		return NULL;
+
+	malloc_lock();
+	if (n > MAXSMALL) {
+		npages = ROUNDUP(MHDR + n, PGSIZE) / PGSIZE;
+		if ((mp = mpage_alloc(npages)) != NULL) {
+			mp->mp_npages = npages;
+			malloc_ninuse += npages * PGSIZE;
+			v = (char *) mp + MHDR;
+		}
+		malloc_unlock();
+		return v;
+	}
+
+	if (!size_class_ready) {
+		for (i = 1, c = 0; i <= MAXSMALL / 16; i++) {
+			if (class_size[c] < i * 16)
+				c++;
+			size_class[i] = c;
+		}
+		size_class_ready = 1;
+	}
+	c = size_class[(n + 15) / 16];
+	if ((mp = class_pages[c]) || (mp = class_grow(c))) {
+		v = mp->mp_free;
+		mp->mp_free = *(void **) v;
+		mp->mp_inuse++;
+		if (!mp->mp_free)
+			class_unlink(mp);
+		malloc_ninuse += class_size[c];
+	}
+	malloc_unlock();
+	return v;
+}
+
+//
+// Free v, returned by malloc.  free(NULL) does nothing.
+//
+void
+free(void *v)
+{
+	struct MPage *mp;
+	int c;
+
+	if (v == NULL)
+		return;
+	assert((uintptr_t) v >= MBEGIN + MHDR && (uintptr_t) v < MEND);
+
+	malloc_lock();
+	mp = ROUNDDOWN(v, PGSIZE);
+	if (mp->mp_npages) {
+		assert(v == (char *) mp + MHDR);
+		malloc_ninuse -= mp->mp_npages * PGSIZE;
+		mpage_free(mp, mp->mp_npages);
+		malloc_unlock();
+		return;
+	}
+
+	c = mp->mp_class;
+	if (!mp->mp_free)
+		class_link(mp);
+	*(void **) v = mp->mp_free;
+	mp->mp_free = v;
+	mp->mp_inuse--;
+	malloc_ninuse -= class_size[c];
+	if (mp->mp_inuse == 0 && (mp->mp_prev || mp->mp_next)) {
+		class_unlink(mp);
+		mpage_free(mp, 1);
+	}
+	malloc_unlock();
+}
+
+//
+// Report the bytes handed out by malloc (rounded up to the size class,
+// or to whole pages for large objects), and the bytes of heap mapped.
+//
+void
+malloc_stats(size_t *inuse, size_t *mapped)
+{
+	malloc_lock();
+	*inuse = malloc_ninuse;
+	*mapped = malloc_nmapped * PGSIZE;
+	malloc_unlock();
+}
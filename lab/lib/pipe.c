@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #define debug 0
@@ -22,9 +23,30 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_seq;		// futex, bumped whenever the positions move
+	uint32_t p_sleepers;	// number of envs sleeping on p_seq
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// Sleep until the other end moves (see pipe_wake) or goes away, unless
+// it already has since we read seq.
+static void
+pipe_sleep(struct Pipe *p, uint32_t seq)
+{
+	xadd(&p->p_sleepers, 1);
+	sys_futex_wait(&p->p_seq, seq);
+	xadd(&p->p_sleepers, -1);
+}
+
+// Tell the other end that we've moved our position.
+static void
+pipe_wake(struct Pipe *p)
+{
+	xadd(&p->p_seq, 1);
+	if (p->p_sleepers)
+		sys_futex_wake(&p->p_seq, NENV);
+}
+
 int
 pipe(int pfd[2])
 {
@@ -106,6 +128,7 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -119,20 +142,26 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
+			if (debug)
+				cprintf("devpipe_read sleep\n");
 			// if all the writers are gone, note eof
+			// (and make no system call from here until we
+			// sleep: see sys_futex_wait)
+			seq = p->p_seq;
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+			// sleep until something happens
+			if (p->p_rpos == p->p_wpos)
+				pipe_sleep(p, seq);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+    out:
+	pipe_wake(p);
 	return i;
 }
 
@@ -141,6 +170,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
 	size_t i;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -152,15 +182,22 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 	for (i = 0; i < n; i++) {
 		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
 			// pipe is full
+			// let the readers at what we wrote so far
+			if (i > 0)
+				pipe_wake(p);
+			if (debug)
+				cprintf("devpipe_write sleep\n");
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
+			// (and make no system call from here until we
+			// sleep: see sys_futex_wait)
+			seq = p->p_seq;
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+			// sleep until something happens
+			if (p->p_wpos >= p->p_rpos + sizeof(p->p_buf))
+				pipe_sleep(p, seq);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +205,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(p);
 	return i;
 }
 
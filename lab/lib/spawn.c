@@ -126,20 +126,22 @@ spawn(const char *prog, const char **argv)
 	close(fd);
 	fd = -1;
 
-	// Copy shared library state.
+	// Copy shared library state.  The mappings are only queued and go
+	// in, together with the trap frame and status, in one flush.
 	if ((r = copy_shared_pages(child)) < 0)
-		panic("copy_shared_pages: %e", r);
+		goto error;
 
 	child_tf.tf_eflags |= FL_IOPL_3;   // devious: see user/faultio.c
-	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
-		panic("sys_env_set_trapframe: %e", r);
-
-	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
+	if ((r = sysring_queue(SYS_env_set_trapframe, child, (uint32_t) &child_tf, 0, 0, 0)) < 0
+	    || (r = sysring_queue(SYS_env_set_status, child, ENV_RUNNABLE, 0, 0, 0)) < 0
+	    || (r = sysring_flush()) < 0)
+		goto error;
 
 	return child;
 
 error:
+	// Nothing queued for the child may run after it is gone.
+	sysring_discard();
 	sys_env_destroy(child);
 	close(fd);
 	return r;
@@ -362,25 +364,37 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
+	// Batch the calls through the ring: each file page costs one
+	// flush (mapping the previous page into the child and allocating
+	// a fresh UTEMP) besides its read.  Re-allocating UTEMP replaces
+	// the old mapping, so it needs unmapping only at the end.
+	// On failure, drop what is still queued: it targets a child that
+	// is about to be destroyed.
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
+			if ((r = sysring_queue(SYS_page_alloc, child, va + i, perm, 0, 0)) < 0)
+				goto fail;
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
+			if ((r = sysring_queue(SYS_page_alloc, 0, (uint32_t) UTEMP, PTE_P|PTE_U|PTE_W, 0, 0)) < 0
+			    || (r = sysring_flush()) < 0)
+				goto fail;
 			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
+				goto fail;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+				goto fail;
+			if ((r = sysring_queue(SYS_page_map, 0, (uint32_t) UTEMP, child, va + i, perm)) < 0)
+				goto fail;
 		}
 	}
-	return 0;
+	if ((r = sysring_queue(SYS_page_unmap, 0, (uint32_t) UTEMP, 0, 0, 0)) < 0)
+		goto fail;
+	return sysring_flush();
+
+fail:
+	sysring_discard();
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -389,9 +403,13 @@ copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
     uint32_t addr;
+    int r;
     for(addr=0;addr<UTOP;addr+=PGSIZE){
         if((uvpd[PDX(addr)]&PTE_P) && (uvpt[PGNUM(addr)]&PTE_P) && (uvpt[PGNUM(addr)]&PTE_SHARE)){
-            sys_page_map(0,(void*)addr,child,(void*)addr,uvpt[PGNUM(addr)]&PTE_SYSCALL);
+            if((r=sysring_queue(SYS_page_map,0,addr,child,addr,uvpt[PGNUM(addr)]&PTE_SYSCALL))<0){
+                sysring_discard();
+                return r;
+            }
         }
     }
 	return 0;
@@ -1,13 +1,43 @@
 // System call stubs.
 
 #include <inc/syscall.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
+// Whether to enter the kernel through sysenter: 0 until checked,
+// then 1 or -1.  The kernel sets up sysenter on exactly the CPUs
+// where cpu_has_sysenter() holds.
+static int sysenter_state;
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+	if (sysenter_state == 0)
+		sysenter_state = cpu_has_sysenter() ? 1 : -1;
+
+	// Fast system call: number in AX, up to four parameters in DX,
+	// CX, BX, DI, our return address in SI and stack pointer in BP.
+	// The kernel comes back by sysexit with the return value in AX
+	// and DX and CX overwritten; BP is saved on the stack because the
+	// compiler won't let us clobber it.
+	if (sysenter_state > 0 && a5 == 0) {
+		asm volatile("pushl %%ebp\n\t"
+			     "movl %%esp, %%ebp\n\t"
+			     "leal 1f, %%esi\n\t"
+			     "sysenter\n"
+			     "1:\tpopl %%ebp\n"
+			     : "=a" (ret),
+			       "+d" (a1),
+			       "+c" (a2)
+			     : "a" (num),
+			       "b" (a3),
+			       "D" (a4)
+			     : "esi", "cc", "memory");
+		goto out;
+	}
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -31,6 +61,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		       "S" (a5)
 		     : "cc", "memory");
 
+out:
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -61,6 +92,18 @@ sys_getenvid(void)
 	 return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
 }
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
 void
 sys_yield(void)
 {
@@ -115,6 +158,24 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 1, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
@@ -126,3 +187,45 @@ sys_exec(uint32_t eip, uint32_t esp, void * ph, uint32_t phnum)
 {
     return syscall(SYS_exec, 0, eip, esp, (uint32_t)ph, phnum, 0);
 }
+
+int
+sys_ring_enter(struct SysRing *ring)
+{
+	return syscall(SYS_ring_enter, 0, (uint32_t) ring, 0, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t uxstacktop)
+{
+	return syscall(SYS_thread_create, 0, eip, esp, uxstacktop, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_notify_wait(uint32_t mask)
+{
+	return syscall(SYS_notify_wait, 0, mask, 0, 0, 0, 0);
+}
+
+int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, (uint32_t) va, len, perm, 0, 0);
+}
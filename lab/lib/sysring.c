@@ -0,0 +1,81 @@
+// Batched system calls through the ring at USYSRING (each thread has
+// its own; see thread_sysring).
+//
+// sysring_queue() queues a call without entering the kernel;
+// sysring_flush() runs everything queued with as few sys_ring_enter
+// traps as the ring size allows; sysring_discard() drops it instead.
+// Only the calls listed in inc/syscall.h may be queued.
+
+#include <inc/lib.h>
+
+static struct SysRing *
+sysring(void)
+{
+	struct SysRing *ring = thread_sysring();
+	int r;
+
+	// spawn doesn't give the child a ring page, so map a fresh
+	// (zeroed, hence empty) one on first use.
+	if (!(uvpd[PDX(ring)] & PTE_P) || !(uvpt[PGNUM(ring)] & PTE_P))
+		if ((r = sys_page_alloc(0, ring, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sysring: %e", r);
+	return ring;
+}
+
+// Queue system call 'num', flushing the ring first if it is full.
+// Returns 0, or the error from such a flush.
+int
+sysring_queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	      uint32_t a4, uint32_t a5)
+{
+	struct SysRing *ring = sysring();
+	struct SysRingEntry *sqe;
+	int r;
+
+	if (ring->sq_tail - ring->sq_head == SYSRING_SIZE
+	    && (r = sysring_flush()) < 0)
+		return r;
+	sqe = &ring->sq[ring->sq_tail % SYSRING_SIZE];
+	sqe->num = num;
+	sqe->args[0] = a1;
+	sqe->args[1] = a2;
+	sqe->args[2] = a3;
+	sqe->args[3] = a4;
+	sqe->args[4] = a5;
+	ring->sq_tail++;
+	return 0;
+}
+
+// Run every queued call, in order.  Returns 0 if all of them succeeded.
+// Otherwise returns the first failure; the calls queued after it are
+// dropped without being run.
+int
+sysring_flush(void)
+{
+	struct SysRing *ring = sysring();
+	int r, err = 0;
+
+	while (ring->sq_head != ring->sq_tail) {
+		if ((r = sys_ring_enter(ring)) < 0)
+			err = r;
+		for (; ring->cq_head != ring->cq_tail; ring->cq_head++)
+			if (ring->cq[ring->cq_head % SYSRING_SIZE] < 0 && !err)
+				err = ring->cq[ring->cq_head % SYSRING_SIZE];
+		if (err) {
+			ring->sq_tail = ring->sq_head;
+			return err;
+		}
+	}
+	return 0;
+}
+
+// Drop every queued call without running it.  Callers that give up
+// halfway through a batch must do this, or the next flush, perhaps from
+// unrelated code, would run the stale calls.
+void
+sysring_discard(void)
+{
+	struct SysRing *ring = sysring();
+
+	ring->sq_tail = ring->sq_head;
+}
@@ -0,0 +1,168 @@
+// Threads: environments sharing our address space (see the kernel's
+// sys_thread_create), each with its own stack and exception stack.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+// Threads live in slots of UTHREADSLOT bytes starting at UTHREADS,
+// below ETEMP.  Slot i holds, from the bottom up:
+//
+//	one guard page
+//	the thread's exception stack (one page)
+//	its struct ThreadInfo (one page)
+//	one guard page
+//	...
+//	its stack, the top THREADSTKSIZE bytes of which are mapped
+//
+// Code finds out which thread it runs on from its stack pointer.  The
+// initial thread's stacks are the usual ones at USTACKTOP and
+// UXSTACKTOP, outside of any slot.
+#define UTHREADS	0xDC000000
+#define UTHREADSLOT	(32 * PGSIZE)
+#define NTHREAD		64
+#define THREADSTKSIZE	(2 * PGSIZE)
+
+#define SLOTBASE(i)	(UTHREADS + (i) * UTHREADSLOT)
+#define SLOTUXSTACK(i)	(SLOTBASE(i) + PGSIZE)
+#define SLOTINFO(i)	((struct ThreadInfo *) (SLOTBASE(i) + 2 * PGSIZE))
+#define SLOTSTACK(i)	(SLOTBASE(i) + UTHREADSLOT - THREADSTKSIZE)
+
+// Per-thread state of the library.
+struct ThreadInfo {
+	const volatile struct Env *ti_env;	// The thread's thisenv
+	struct SysRing ti_ring;			// Its system call ring
+};
+
+static const volatile struct Env *thisenv_main;
+static volatile uint32_t thread_used[NTHREAD];
+static envid_t thread_envs[NTHREAD];
+
+// Return the slot of the thread we are running on, or -1 for the
+// initial thread.
+static int
+thread_slot(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp < UTHREADS || esp >= SLOTBASE(NTHREAD))
+		return -1;
+	return (esp - UTHREADS) / UTHREADSLOT;
+}
+
+// Where the calling thread keeps thisenv.
+const volatile struct Env **
+thisenv_ptr(void)
+{
+	int i = thread_slot();
+
+	return i < 0 ? &thisenv_main : &SLOTINFO(i)->ti_env;
+}
+
+// The calling thread's system call ring (see sysring.c).
+struct SysRing *
+thread_sysring(void)
+{
+	int i = thread_slot();
+
+	return i < 0 ? (struct SysRing *) USYSRING : &SLOTINFO(i)->ti_ring;
+}
+
+// Unmap slot i's pages and make it available again.
+static void
+thread_free(int i)
+{
+	uintptr_t va;
+
+	sysring_queue(SYS_page_unmap, 0, SLOTUXSTACK(i), 0, 0, 0);
+	sysring_queue(SYS_page_unmap, 0, (uint32_t) SLOTINFO(i), 0, 0, 0);
+	for (va = SLOTSTACK(i); va < SLOTBASE(i + 1); va += PGSIZE)
+		sysring_queue(SYS_page_unmap, 0, va, 0, 0, 0);
+	sysring_flush();
+	thread_envs[i] = 0;
+	thread_used[i] = 0;
+}
+
+static void
+thread_main(void (*fn)(void *), void *arg)
+{
+	thisenv = &envs[ENVX(sys_getenvid())];
+	fn(arg);
+	thread_exit();
+}
+
+//
+// Start a thread running fn(arg) in our address space, on a stack of
+// its own.  Returning from fn ends the thread, like thread_exit().
+// Threads share everything else, file descriptors included, so one
+// calling exit() closes them for all of them.
+//
+// Returns the new thread's envid (for thread_join), or < 0 on error:
+//	-E_NO_FREE_ENV if all NTHREAD slots, or all environments, are
+//		in use.
+//	-E_NO_MEM on memory exhaustion.
+//
+envid_t
+thread_create(void (*fn)(void *), void *arg)
+{
+	uintptr_t va, *esp;
+	envid_t tid;
+	int i, r;
+
+	static_assert(sizeof(struct ThreadInfo) <= PGSIZE);
+
+	for (i = 0; i < NTHREAD; i++)
+		if (xchg(&thread_used[i], 1) == 0)
+			break;
+	if (i == NTHREAD)
+		return -E_NO_FREE_ENV;
+
+	sysring_queue(SYS_page_alloc, 0, SLOTUXSTACK(i), PTE_P|PTE_U|PTE_W, 0, 0);
+	sysring_queue(SYS_page_alloc, 0, (uint32_t) SLOTINFO(i), PTE_P|PTE_U|PTE_W, 0, 0);
+	for (va = SLOTSTACK(i); va < SLOTBASE(i + 1); va += PGSIZE)
+		sysring_queue(SYS_page_alloc, 0, va, PTE_P|PTE_U|PTE_W, 0, 0);
+	if ((r = sysring_flush()) < 0)
+		goto fail;
+
+	// Call thread_main(fn, arg) on the new stack.
+	esp = (uintptr_t *) SLOTBASE(i + 1);
+	*--esp = (uintptr_t) arg;
+	*--esp = (uintptr_t) fn;
+	*--esp = 0;
+	if ((r = tid = sys_thread_create((uintptr_t) thread_main, (uintptr_t) esp,
+					 SLOTUXSTACK(i) + PGSIZE)) < 0)
+		goto fail;
+	thread_envs[i] = tid;
+	return tid;
+
+fail:
+	thread_free(i);
+	return r;
+}
+
+// End the calling thread.  The address space lives on as long as any
+// thread is left.
+void
+thread_exit(void)
+{
+	sys_env_destroy(0);
+}
+
+//
+// Wait for thread tid, created by thread_create, to end, and release
+// its stacks.  Returns its exit status, as wait() does (-E_BAD_ENV if
+// it was already gone), or -E_INVAL if tid is no thread of ours.
+//
+int
+thread_join(envid_t tid)
+{
+	int i, r;
+
+	for (i = 0; i < NTHREAD; i++)
+		if (thread_used[i] && thread_envs[i] == tid)
+			break;
+	if (i == NTHREAD)
+		return -E_INVAL;
+	r = wait(tid);
+	thread_free(i);
+	return r;
+}
@@ -1,13 +1,15 @@
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
-void
+// Waits until 'envid' exits, sleeping in the kernel rather than polling.
+// Returns the exit status of 'envid' (0, or -E_FAULT if the kernel killed
+// it), or -E_BAD_ENV if it had already exited.
+int
 wait(envid_t envid)
 {
-	const volatile struct Env *e;
+	int r;
 
 	assert(envid != 0);
-	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	if ((r = sys_env_wait(envid)) < 0)
+		return r;
+	return thisenv->env_wait_status;
 }
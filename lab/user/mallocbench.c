@@ -0,0 +1,86 @@
+// Benchmark malloc and free: a random mix of allocations and frees over
+// a working set of live objects, mostly small with some large ones.
+// Reports cycles per operation, and how much of the mapped heap the live
+// objects actually use.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NSLOT	512
+#define NOP	200000
+
+static char *slots[NSLOT];
+static size_t sizes[NSLOT];
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static size_t
+randsize(void)
+{
+	uint32_t r = rand();
+
+	if (r % 64 == 0)
+		return PGSIZE + r % (4 * PGSIZE);	// Large
+	return 1 + r % ((r & 0x100) ? 512 : 64);	// Small, mostly tiny
+}
+
+void
+umain(int argc, char **argv)
+{
+	size_t live = 0, peaklive = 0, inuse, mapped, peakmapped = 0;
+	uint64_t start, cycles;
+	int i, n;
+
+	start = read_tsc();
+	for (n = 0; n < NOP; n++) {
+		i = rand() % NSLOT;
+		if (slots[i]) {
+			if (slots[i][0] != (char) i
+			    || slots[i][sizes[i] - 1] != (char) i)
+				panic("slot %d: object corrupted", i);
+			free(slots[i]);
+			live -= sizes[i];
+			slots[i] = NULL;
+			continue;
+		}
+		sizes[i] = randsize();
+		if ((slots[i] = malloc(sizes[i])) == NULL)
+			panic("malloc(%d) failed", sizes[i]);
+		if ((uintptr_t) slots[i] % 16)
+			panic("malloc(%d) = %08x: misaligned", sizes[i], slots[i]);
+		slots[i][0] = slots[i][sizes[i] - 1] = i;
+		live += sizes[i];
+		if (live > peaklive)
+			peaklive = live;
+		if (n % 1024 == 0) {
+			malloc_stats(&inuse, &mapped);
+			if (mapped > peakmapped)
+				peakmapped = mapped;
+		}
+	}
+	cycles = read_tsc() - start;
+
+	malloc_stats(&inuse, &mapped);
+	cprintf("mallocbench: %d ops, %d cycles/op\n",
+		NOP, (uint32_t) (cycles / NOP));
+	cprintf("mallocbench: %d bytes live in %d bytes (%d bytes mapped)\n",
+		live, inuse, mapped);
+	cprintf("mallocbench: peak %d bytes live, %d bytes mapped\n",
+		peaklive, peakmapped);
+
+	for (i = 0; i < NSLOT; i++)
+		free(slots[i]);
+	malloc_stats(&inuse, &mapped);
+	if (inuse != 0)
+		panic("%d bytes still in use after freeing everything", inuse);
+	cprintf("mallocbench: %d bytes mapped after freeing everything\n",
+		mapped);
+}
@@ -0,0 +1,43 @@
+// Test blocking IPC sends: several children queue up on the parent,
+// which only starts receiving once they are all blocked.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NMSG	3
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD], who;
+	int next[NCHILD];
+	int i, j, v;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			for (j = 0; j < NMSG; j++)
+				ipc_send(thisenv->env_parent_id, i * 100 + j, 0, 0);
+			return;
+		}
+		next[i] = 0;
+	}
+
+	// Give every child the chance to block in sys_ipc_send.
+	for (i = 0; i < 20; i++)
+		sys_yield();
+
+	for (i = 0; i < NCHILD * NMSG; i++) {
+		v = ipc_recv(&who, 0, 0);
+		for (j = 0; j < NCHILD; j++)
+			if (kids[j] == who)
+				break;
+		if (j == NCHILD)
+			panic("message %d from unknown env %08x", v, who);
+		if (v != j * 100 + next[j])
+			panic("env %08x: got %d, expected %d", who, v, j * 100 + next[j]);
+		next[j]++;
+	}
+	cprintf("sendqueue: all %d messages delivered in order\n", NCHILD * NMSG);
+}
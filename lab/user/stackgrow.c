@@ -0,0 +1,51 @@
+// Test the growing user stack: deep recursion with big frames runs
+// without mapping its stack first, and running off the bottom of the
+// stack kills a child at the guard page.
+
+#include <inc/lib.h>
+
+#define FRAME	(16 * 1024)
+
+static uint32_t
+recurse(int depth)
+{
+	volatile char buf[FRAME];
+	int i;
+
+	// Touch every page, top down, as a growing stack would.
+	for (i = FRAME - 1; i >= 0; i -= PGSIZE)
+		buf[i] = depth;
+	if (depth == 0)
+		return 0;
+	return recurse(depth - 1) + buf[FRAME - 1];
+}
+
+static bool
+mapped(uintptr_t va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r, depth = USTACKSIZE / FRAME / 2;
+
+	if (mapped(USTACKTOP - USTACKSIZE / 2))
+		panic("stack mapped before it was used");
+	if ((r = recurse(depth)) != depth * (depth + 1) / 2)
+		panic("recurse(%d) = %d", depth, r);
+	if (!mapped(USTACKTOP - USTACKSIZE / 2 + PGSIZE))
+		panic("stack did not grow");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		recurse(USTACKSIZE / FRAME + 1);
+		panic("recursed past the stack guard");
+	}
+	if ((r = wait(child)) != -E_FAULT)
+		panic("child overflowing its stack exited with %e", r);
+	cprintf("stack growth ok\n");
+}
@@ -0,0 +1,38 @@
+// Test futexes: a child sleeps on a word in a PTE_SHARE page until the
+// parent changes it.
+
+#include <inc/lib.h>
+
+#define SHARED	((volatile uint32_t *) 0xA0000000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r, n;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_futex_wait(SHARED, 1)) != -E_AGAIN)
+		panic("sys_futex_wait on a changed word returned %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (*SHARED == 0)
+			sys_futex_wait(SHARED, 0);
+		SHARED[1] = *SHARED + 1;
+		return;
+	}
+
+	// Wait for the child to go to sleep.
+	for (n = 0; n < 100 && envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE; n++)
+		sys_yield();
+	*SHARED = 41;
+	if ((n = sys_futex_wake(SHARED, NENV)) != 1)
+		cprintf("woke %d envs, expected 1\n", n);
+	wait(child);
+	if (SHARED[1] != 42)
+		panic("child saw %d, expected 42", SHARED[1] - 1);
+	cprintf("futex ok\n");
+}
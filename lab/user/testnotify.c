@@ -0,0 +1,36 @@
+// Test notifications: a child blocks in sys_notify_wait until the parent
+// sends it one of the bits it waits for, and bits sent early are kept.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child;
+	int n, r;
+
+	if ((r = sys_notify_wait(0)) != -E_INVAL)
+		panic("sys_notify_wait(0) returned %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_notify_wait(0x6)) != 0x4)
+			panic("child woke with bits %x, expected 4", r);
+		sys_notify(parent, 0x1);
+		return;
+	}
+
+	// Wait for the child to go to sleep.
+	for (n = 0; n < 100 && envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE; n++)
+		sys_yield();
+	// Bit 0 is not one the child waits for, so it sleeps on.
+	if ((r = sys_notify(child, 0x1)) < 0)
+		panic("sys_notify: %e", r);
+	if ((r = sys_notify(child, 0x4)) < 0)
+		panic("sys_notify: %e", r);
+	if ((r = sys_notify_wait(0x1)) != 0x1)
+		panic("parent woke with bits %x, expected 1", r);
+	wait(child);
+	cprintf("notify ok\n");
+}
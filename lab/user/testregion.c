@@ -0,0 +1,54 @@
+// Test anonymous regions: a big sparse region costs nothing until it is
+// touched, its pages come up zeroed on first touch without a page fault
+// upcall, and a forked child gets the region too.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x20000000)
+#define LEN	(64 * 1024 * 1024)
+#define STRIDE	(1024 * 1024 + PGSIZE)
+
+static bool
+mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	uint32_t off;
+	int r;
+
+	if ((r = sys_region_reserve(REGION, LEN, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if ((r = sys_region_reserve(REGION + LEN - PGSIZE, PGSIZE,
+				    PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("overlapping sys_region_reserve returned %e", r);
+	if (mapped(REGION))
+		panic("region mapped before it was touched");
+
+	for (off = 0; off < LEN; off += STRIDE) {
+		if (REGION[off] != 0 || REGION[off + PGSIZE - 1] != 0)
+			panic("page at %08x not zeroed", REGION + off);
+		REGION[off] = off / STRIDE + 1;
+	}
+	if (mapped(REGION + PGSIZE))
+		panic("untouched page in the region got mapped");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (off = 0; off < LEN; off += STRIDE)
+			if (REGION[off] != off / STRIDE + 1)
+				panic("child sees %d at %08x", REGION[off],
+				      REGION + off);
+		REGION[PGSIZE] = 1;	// Untouched, so still reserved
+		return;
+	}
+	wait(child);
+	if (mapped(REGION + PGSIZE))
+		panic("child's page showed up in the parent");
+	cprintf("region ok\n");
+}
@@ -0,0 +1,53 @@
+// Test threads: CPU-bound workers share our memory but each has its own
+// stack and thisenv, and can run on every CPU at once.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NWORKER	4
+#define NITER	1000000
+
+static uint32_t sums[NWORKER];
+static envid_t ids[NWORKER];
+static volatile uint32_t done;
+
+static void
+worker(void *arg)
+{
+	uint32_t i, n = (uint32_t) arg, sum = 0;
+
+	for (i = 0; i < NITER; i++)
+		sum += i ^ n;
+	sums[n] = sum;
+	ids[n] = thisenv->env_id;
+	__sync_fetch_and_add(&done, 1);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t tids[NWORKER];
+	uint32_t i, n, sum;
+	int r;
+
+	for (n = 0; n < NWORKER; n++)
+		if ((tids[n] = thread_create(worker, (void *) n)) < 0)
+			panic("thread_create: %e", tids[n]);
+	for (n = 0; n < NWORKER; n++)
+		if ((r = thread_join(tids[n])) < 0)
+			panic("thread_join: %e", r);
+
+	if (done != NWORKER)
+		panic("%d of %d workers done", done, NWORKER);
+	for (n = 0; n < NWORKER; n++) {
+		for (sum = 0, i = 0; i < NITER; i++)
+			sum += i ^ n;
+		if (sums[n] != sum)
+			panic("worker %d: sum %08x, expected %08x", n, sums[n], sum);
+		if (ids[n] != tids[n])
+			panic("worker %d: thisenv %08x, expected %08x", n, ids[n], tids[n]);
+	}
+	if (thisenv->env_id != sys_getenvid())
+		panic("thisenv changed under the initial thread");
+	cprintf("threads: %d workers ok\n", NWORKER);
+}